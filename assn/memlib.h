@@ -6,3 +6,15 @@ void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+
+#ifdef MEMLIB_OS
+/* Non-contiguous heap segments, only provided by memlib_os.c */
+void *mem_new_segment(size_t size);
+int mem_segments(void);
+void *mem_segment_lo(int i);
+void *mem_segment_hi(int i);
+size_t mem_segment_reserved(int i);
+int mem_restore_segment(void *start, size_t reserved, size_t size);
+void mem_set_hugepages(int enable);
+size_t mem_hugepagesize(void);
+#endif
@@ -0,0 +1,337 @@
+/*
+ * memlib_os.c - a drop-in replacement for memlib.o that hands out real
+ *               OS memory instead of a fixed malloc'ed sandbox. Used by the
+ *               LD_PRELOAD build (libmm.so), where the allocator must not
+ *               call back into libc malloc.
+ *
+ * The heap is made of one or more segments. Each segment reserves a
+ * range of address space with no access rights at all, and mem_sbrk()
+ * commits it (makes it readable and writable) COMMIT_SIZE bytes at a time
+ * as the break moves up, so nothing is touched at startup. mem_sbrk()
+ * always grows the most recent segment; once its reservation is used up
+ * the allocator can start another, non-contiguous one with
+ * mem_new_segment() and lay down a fresh prologue and epilogue in it.
+ *
+ * The reservation of each segment defaults to MAX_HEAP and can be
+ * overridden with the MEMLIB_MAX_HEAP environment variable (in bytes).
+ *
+ * Huge page mode (MEMLIB_HUGEPAGES=1 or mem_set_hugepages(1) before
+ * mem_init()) aligns every segment to HUGE_PAGE_SIZE, commits whole huge
+ * pages, and asks for transparent huge pages with MADV_HUGEPAGE once a
+ * segment has grown past HUGE_THRESHOLD.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "memlib.h"
+
+#define MAX_HEAP     ((size_t)1 << 32)  /* default reservation per segment: 4 GB */
+#define COMMIT_SIZE  (1 << 16)          /* commit granularity: 64 KB */
+#define MAX_SEGMENTS 256                /* most segments a heap can have */
+#define HUGE_PAGE_SIZE (1 << 21)        /* transparent huge page size: 2 MB */
+#define HUGE_THRESHOLD (1 << 22)        /* segments this large get huge pages */
+
+/* One contiguous piece of the heap */
+typedef struct {
+    char *start;       /* first byte of the segment */
+    char *brk;         /* one past the last heap byte */
+    char *committed;   /* one past the last readable/writable byte */
+    char *max_addr;    /* one past the end of the reservation */
+} segment_t;
+
+/* private variables */
+static segment_t segments[MAX_SEGMENTS];
+static int num_segments;
+static size_t reserve_size;   /* default reservation for a new segment */
+static int hugepages = -1;    /* huge page mode; -1 until decided */
+
+/*
+ * reserve - map size bytes of inaccessible address space as segment i
+ */
+static int reserve(int i, size_t size)
+{
+    size_t align = hugepages ? HUGE_PAGE_SIZE : 0;
+    char *start, *aligned;
+
+    if (align)
+        size = (size + align - 1) & ~(align - 1);
+    start = mmap(NULL, size + align, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (start == MAP_FAILED)
+        return -1;
+
+    // Trim the over-reservation so the segment starts on a huge page.
+    if (align) {
+        aligned = (char *)(((uintptr_t)start + align - 1) & ~(uintptr_t)(align - 1));
+        if (aligned > start)
+            munmap(start, aligned - start);
+        munmap(aligned + size, start + align - aligned);
+        start = aligned;
+    }
+
+    segments[i].start = start;
+    segments[i].brk = start;
+    segments[i].committed = start;
+    segments[i].max_addr = start + size;
+    return 0;
+}
+
+/*
+ * commit - make segment s readable and writable up to at least addr
+ */
+static int commit(segment_t *s, char *addr)
+{
+    size_t unit = hugepages ? HUGE_PAGE_SIZE : COMMIT_SIZE;
+    char *from;
+    size_t size;
+
+    if (addr <= s->committed)
+        return 0;
+    size = (addr - s->committed + unit - 1) & ~(size_t)(unit - 1);
+    if (size > (size_t)(s->max_addr - s->committed))
+        size = s->max_addr - s->committed;
+    if (mprotect(s->committed, size, PROT_READ | PROT_WRITE) < 0)
+        return -1;
+
+    // Advise the whole segment when it first crosses the threshold,
+    // and each new commit after that.
+    from = s->committed;
+    s->committed += size;
+    if (hugepages && s->committed - s->start >= HUGE_THRESHOLD) {
+        if (from - s->start < HUGE_THRESHOLD)
+            from = s->start;
+        madvise(from, s->committed - from, MADV_HUGEPAGE);
+    }
+    return 0;
+}
+
+/*
+ * mem_init - reserve the address range for the first heap segment
+ */
+void mem_init(void)
+{
+    char *env = getenv("MEMLIB_MAX_HEAP");
+
+    if (hugepages < 0)
+        hugepages = getenv("MEMLIB_HUGEPAGES") != NULL && atoi(getenv("MEMLIB_HUGEPAGES")) > 0;
+
+    reserve_size = MAX_HEAP;
+    if (env != NULL && strtoull(env, NULL, 0) > 0)
+        reserve_size = (strtoull(env, NULL, 0) + COMMIT_SIZE - 1) & ~(size_t)(COMMIT_SIZE - 1);
+
+    if (reserve(0, reserve_size) < 0) {
+        fprintf(stderr, "mem_init_vm: mmap error\n");
+        exit(1);
+    }
+    num_segments = 1;
+}
+
+/*
+ * mem_deinit - give every segment back to the OS
+ */
+void mem_deinit(void)
+{
+    int i;
+
+    for (i = 0; i < num_segments; i++)
+        munmap(segments[i].start, segments[i].max_addr - segments[i].start);
+    num_segments = 0;
+}
+
+/*
+ * mem_reset_brk - drop the extra segments and decommit the first one
+ *    to make an empty heap
+ */
+void mem_reset_brk(void)
+{
+    segment_t *s = &segments[0];
+    int i;
+
+    for (i = 1; i < num_segments; i++)
+        munmap(segments[i].start, segments[i].max_addr - segments[i].start);
+    num_segments = 1;
+
+    if (s->committed > s->start) {
+        madvise(s->start, s->committed - s->start, MADV_DONTNEED);
+        mprotect(s->start, s->committed - s->start, PROT_NONE);
+    }
+    s->brk = s->start;
+    s->committed = s->start;
+}
+
+/*
+ * mem_sbrk - extends the current (most recent) segment by incr bytes
+ *    and returns the start address of the new area. In this model, the
+ *    heap cannot be shrunk.
+ */
+void *mem_sbrk(intptr_t incr)
+{
+    segment_t *s = &segments[num_segments - 1];
+    char *old_brk = s->brk;
+
+    if ((incr < 0) || ((size_t)(s->max_addr - s->brk) < (size_t)incr)
+            || commit(s, s->brk + incr) < 0) {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    s->brk += incr;
+    return (void *)old_brk;
+}
+
+/*
+ * mem_new_segment - reserve a new, empty segment with room for at least
+ *    size bytes and make it the one mem_sbrk() grows. Returns its first
+ *    byte, or (void *)-1 if no more segments can be added.
+ */
+void *mem_new_segment(size_t size)
+{
+    size = (size + COMMIT_SIZE - 1) & ~(size_t)(COMMIT_SIZE - 1);
+    if (size < reserve_size)
+        size = reserve_size;
+
+    if (num_segments == MAX_SEGMENTS || reserve(num_segments, size) < 0) {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    return (void *)segments[num_segments++].start;
+}
+
+/*
+ * mem_restore_segment - reserve reserved bytes of address space at start
+ *    exactly, commit the first size of them and make it the segment
+ *    mem_sbrk() grows, with its break at start + size. The contents are up
+ *    to the caller. Returns -1 if the range is not free.
+ */
+int mem_restore_segment(void *start, size_t reserved, size_t size)
+{
+    segment_t *s = &segments[num_segments];
+    char *p;
+
+    if (num_segments == MAX_SEGMENTS || size > reserved)
+        return -1;
+#ifdef MAP_FIXED_NOREPLACE
+    p = mmap(start, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+#else
+    p = mmap(start, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#endif
+    if (p == MAP_FAILED)
+        return -1;
+    if (p != start) {
+        munmap(p, reserved);
+        return -1;
+    }
+
+    s->start = p;
+    s->brk = p;
+    s->committed = p;
+    s->max_addr = p + reserved;
+    if (commit(s, p + size) < 0) {
+        munmap(p, reserved);
+        return -1;
+    }
+    s->brk = p + size;
+    num_segments++;
+    return 0;
+}
+
+/*
+ * mem_set_hugepages - turn huge page mode on or off for the next
+ *    mem_init(), overriding MEMLIB_HUGEPAGES
+ */
+void mem_set_hugepages(int enable)
+{
+    hugepages = enable != 0;
+}
+
+/*
+ * mem_hugepagesize - return the huge page size in huge page mode, 0 otherwise
+ */
+size_t mem_hugepagesize(void)
+{
+    return hugepages > 0 ? HUGE_PAGE_SIZE : 0;
+}
+
+/*
+ * mem_segments - return the number of heap segments
+ */
+int mem_segments(void)
+{
+    return num_segments;
+}
+
+/*
+ * mem_segment_reserved - return the size of segment i's reservation
+ */
+size_t mem_segment_reserved(int i)
+{
+    return segments[i].max_addr - segments[i].start;
+}
+
+/*
+ * mem_segment_lo - return address of the first byte of segment i
+ */
+void *mem_segment_lo(int i)
+{
+    return (void *)segments[i].start;
+}
+
+/*
+ * mem_segment_hi - return address of the last byte of segment i
+ */
+void *mem_segment_hi(int i)
+{
+    return (void *)(segments[i].brk - 1);
+}
+
+/*
+ * mem_heap_lo - return address of the lowest heap byte
+ */
+void *mem_heap_lo(void)
+{
+    char *lo = segments[0].start;
+    int i;
+
+    for (i = 1; i < num_segments; i++)
+        if (segments[i].start < lo)
+            lo = segments[i].start;
+    return (void *)lo;
+}
+
+/*
+ * mem_heap_hi - return address of the highest heap byte
+ */
+void *mem_heap_hi(void)
+{
+    char *hi = segments[0].brk;
+    int i;
+
+    for (i = 1; i < num_segments; i++)
+        if (segments[i].brk > hi)
+            hi = segments[i].brk;
+    return (void *)(hi - 1);
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes, summed over segments
+ */
+size_t mem_heapsize(void)
+{
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < num_segments; i++)
+        size += segments[i].brk - segments[i].start;
+    return size;
+}
+
+/*
+ * mem_pagesize() - returns the page size of the system
+ */
+size_t mem_pagesize(void)
+{
+    return (size_t)getpagesize();
+}
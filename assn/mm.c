@@ -13,16 +13,49 @@ realloc) using the segregated free list with the following high-level details:
   4) mm_realloc() is also changed such that if the block is at the end of the heap, it extends
      the heap and return the same pointer passed in instead of doing "free() and malloc()".
      This solves the runtime blow up for realloc-bal.rep.
+  5) mm_malloc_hint() tags a block with a lifetime class (short-lived, long-lived,
+     per-request). Each class has its own set of free lists, grows the heap in
+     chunks of its own and never coalesces with other classes, so long-lived
+     survivors stay packed together and short-lived holes merge into large blocks.
+  6) mm_halloc() hands out relocatable blocks behind a handle. mm_compact() slides
+     unlocked ones down into the free block before them, a few at a time within a
+     time budget, so the holes they leave behind merge with the free space above.
+  7) Built with -DCOMPACT_LINKS, boundary tags are 32 bits and the free list links
+     are 32-bit offsets from the start of the heap, which brings the minimum block
+     down from 32 to 16 bytes (8 payload bytes).
+  8) Next to its list, each bin keeps a dense side index of the sizes and pointers
+     of up to INDEX_SIZE of its free blocks. find_fit() does a best fit over the
+     contiguous sizes with SIMD compares (AVX2 when the CPU has it, else SSE2)
+     instead of chasing list pointers through the heap.
+  9) A block that mm_realloc() keeps moving to grow it is given 50% extra room each
+     time (see GROWTH_MASK), so a growth chain is copied a logarithmic number of
+     times. Shrinking a block to half its size or less gives the tail back.
+ 10) The split threshold of place() and the padding of small size classes are not
+     fixed: they start from defaults and are retuned every POLICY_WINDOW allocations
+     from histograms of the requested sizes, the remainders left inside blocks and
+     the times the heap grew while a block one DSIZE too small was free.
 */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* mremap() */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
+#include "mm_trace.h"
+#include "mm_prof.h"
 
 /*********************************************************
  * NOTE TO STUDENTS: Before you do anything else, please
@@ -47,42 +80,272 @@ team_t team = {
 *************************************************************************/
 #define WSIZE       sizeof(void *)            /* word size (bytes) */
 #define DSIZE       (2 * WSIZE)            /* doubleword size (bytes) */
+/* Boundary tags and free list links: a word each, or 32 bits in the compact
+   mode. Payloads stay DSIZE aligned either way. */
+#ifdef COMPACT_LINKS
+#define TSIZE       4                      /* tag size (bytes) */
+#define MIN_BLOCK   DSIZE
+typedef uint32_t tag_t;
+#else
+#define TSIZE       WSIZE
+#define MIN_BLOCK   (2 * DSIZE)
+typedef uintptr_t tag_t;
+#endif
+/* Free block flag, in the top bit of both tags: the block is in its bin's side
+   index. Sizes never reach that bit. */
+#define INDEXED     ((size_t)1 << (8 * TSIZE - 1))
+/* Allocated block flag, in the same bit: mm_prof.h sampled the block. */
+#define SAMPLED     INDEXED
+/* Allocated block field, in the three bits below INDEXED: how many times in a
+   row mm_realloc() has had to move the block to grow it (saturates at 7). */
+#define GROWTH_SHIFT    (8 * TSIZE - 4)
+#define GROWTH_MASK     ((size_t)7 << GROWTH_SHIFT)
+#define GROWTH_BITS(n)  ((size_t)(n) << GROWTH_SHIFT)
+#define GROWTH_MAX      (1<<20)     /* most room a growing block is given */
+/* Allocated block flag, in the bit below GROWTH: the payload starts and ends
+   on a cache line boundary, with no other payload in its lines. */
+#define ISOLATED        ((size_t)1 << (GROWTH_SHIFT - 1))
+#define CACHELINE       64
+#define LINE_UP(size)   (((size) + CACHELINE - 1) & ~(size_t)(CACHELINE - 1))
+#define MAX_BLOCK   (ISOLATED - DSIZE)  /* largest size a tag holds */
+
+/* Tunables. Each can be overridden with -D at build time; tune.sh searches
+   over them. */
+#ifndef CHUNKSIZE
 #define CHUNKSIZE   (1<<5)      /* initial heap size (bytes) = 32 bytes, four words. This used to be 1<<7*/
+#endif
+#ifndef NUM_OF_FREE_LISTS
 #define NUM_OF_FREE_LISTS 30
-#define LIMIT 1
+#endif
+#ifndef INDEX_SIZE
+#define INDEX_SIZE  64          /* free blocks each bin's side index can hold */
+#endif
+#ifndef LIMIT
+#define LIMIT 1                 /* list blocks looked at in a bin the index misses */
+#endif
+#ifndef SPLIT_DEFAULT
+#define SPLIT_DEFAULT   (9 * DSIZE) /* smallest remainder place() splits off to begin with */
+#endif
+#ifndef PAD_ROUND
+#define PAD_ROUND   32          /* pad blocks of a multiple of this size by DSIZE, 0 for none */
+#endif
+
+/* Adaptive split and padding policy (see retune_policy()) */
+#define POLICY_CLASSES  64          /* block sizes below 64 * DSIZE are tracked one by one */
+#define POLICY_WINDOW   4096        /* allocations between retunes */
+#define POLICY_MISSES   8           /* misses in a window that make a class padded */
+#define POLICY_IDLE     4           /* windows a padded class may go unused before it is not */
+#define CLASS(size)     ((size) / DSIZE)
+
+/* Sample an allocation for the heap profiler (mm_prof.h) */
+#define PROF_MALLOC(bp, size) do { \
+    if (PROF_DUE(size) && PROF_SAMPLE(bp, size)) { \
+        PUT(HDRP(bp), GET(HDRP(bp)) | SAMPLED); \
+        PUT(FTRP(bp), GET(FTRP(bp)) | SAMPLED); \
+    } } while (0)
+/* The free list a block size maps to, as add_free_block() finds it */
+#define SIZE_BIN(size)  ((size) <= 1 ? 0 : MIN(NUM_OF_FREE_LISTS - 1, 64 - __builtin_clzll((unsigned long long)(size) - 1)))
+#define PADDED(size)    (PAD_ROUND && (size) % (PAD_ROUND + !PAD_ROUND) == 0)
 
 #define MAX(x,y) ((x) > (y)?(x) :(y))
+#define MIN(x,y) ((x) < (y)?(x) :(y))
+
+/* Free blocks of at least RELEASE_THRESHOLD bytes give the whole pages in
+   their interior back to the OS. Only done for memlib_os.c heaps, whose pages
+   read back as zero afterwards (as do freshly committed ones). */
+#ifdef MEMLIB_OS
+#define RELEASE_THRESHOLD   (1<<16)
+#define FRESH               ZEROED
+#else
+#define RELEASE_THRESHOLD   0
+#define FRESH               0
+#endif
+/* Free block flag: every whole page between the link words and the footer
+   reads as zero. Dropped as soon as the block is allocated or merged. */
+#define ZEROED      0x2
+
+/* Lifetime class of a block (MM_HINT_*), kept in bits 2-3 of both boundary tags */
+#define NUM_OF_HINTS    4
+#define HINT_MASK       0xc
+#define HINT_BITS(hint) ((size_t)(hint) << 2)
+#define GET_HINT(p)     ((GET(p) & HINT_MASK) >> 2)
+#define HINT_CHUNKSIZE  (1<<16)     /* heap growth for the hinted classes */
+
+/* Allocated block flag: the block belongs to a handle and may be moved by
+   mm_compact(). It shares the bit with ZEROED, which only free blocks have.
+   The first two payload words hold the handle and the lock count. */
+#define RELOC           0x2
+#define HANDLE_CHUNK    32          /* handles allocated at a time */
+#define COMPACT_CHECK   64          /* blocks walked between clock reads */
+
+/* Pages are released whole; in huge page mode, whole huge pages. */
+#ifdef MEMLIB_OS
+#define RELEASE_PAGESIZE()  (mem_hugepagesize() ? mem_hugepagesize() : mem_pagesize())
+#else
+#define RELEASE_PAGESIZE()  mem_pagesize()
+#endif
+#define PAGE_UP(p)      ((char *)(((uintptr_t)(p) + RELEASE_PAGESIZE() - 1) & ~(uintptr_t)(RELEASE_PAGESIZE() - 1)))
+#define PAGE_DOWN(p)    ((char *)((uintptr_t)(p) & ~(uintptr_t)(RELEASE_PAGESIZE() - 1)))
+/* mm_realloc() moves of at least LARGE_COPY bytes go through copy_large().
+   Over memlib_os.c heaps, whose pages are private anonymous memory, such
+   blocks are moved to page aligned payloads, so that from the second move on
+   their whole pages can be remapped instead of copied. What is still copied
+   bypasses the cache once it is over 3/4 of the last level cache, which it
+   would otherwise flush (NT_COPY_DEFAULT if the size is unknown). */
+#ifndef LARGE_COPY
+#define LARGE_COPY      (1<<18)
+#endif
+#define NT_COPY_DEFAULT (1<<22)
+#define NT_PREFETCH     512         /* bytes copy_nt() reads ahead */
+/* Each mremap() into the heap leaves the moved pages in a mapping of their own
+   (they keep their old file offset, so the kernel cannot merge them with their
+   neighbours). Only copies of REMAP_MIN bytes or more are remapped, and only
+   the first REMAP_LIMIT of them, so that a process that keeps growing large
+   blocks stays far below vm.max_map_count (65530 by default). */
+#ifndef REMAP_MIN
+#define REMAP_MIN       (1<<20)
+#endif
+#ifndef REMAP_LIMIT
+#define REMAP_LIMIT     4096
+#endif
+#ifdef MEMLIB_OS
+#define REMAP_PAGES     1
+#else
+#define REMAP_PAGES     0
+#endif
+
+/* mm_snapshot() files: a header with the build's layout, one entry per heap
+   segment, the allocator's globals, then the contents of every segment. */
+#define SNAPSHOT_MAGIC      "mmsnap1"
+#define SNAPSHOT_SEGMENTS   256     /* most segments a snapshot can have */
+
+/* mm_scavenge() marks the free blocks it walks past with the pass number, in
+   the word after the link words; one still marked from the last pass is cold. */
+#define SCAVENGE_STAMP(pass)    ((uintptr_t)0x5ca7e9e5ca7e9e00ULL ^ (uintptr_t)(pass))
 
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc) ((size) | (alloc))
-/* Read and write a word at address p */
-#define GET(p)          (*(uintptr_t *)(p))
-#define PUT(p,val)      (*(uintptr_t *)(p) = (val))
+/* Read and write a tag at address p */
+#define GET(p)          ((size_t)*(tag_t *)(p))
+#define PUT(p,val)      (*(tag_t *)(p) = (tag_t)(val))
+/* Read and write a full word at address p */
+#define GET_WORD(p)     (*(uintptr_t *)(p))
+#define PUT_WORD(p,val) (*(uintptr_t *)(p) = (val))
 
 /* Read the size and allocated fields from address p */
-#define GET_SIZE(p)     (GET(p) & ~(DSIZE - 1))
+#define GET_SIZE(p)     (GET(p) & MAX_BLOCK)
 #define GET_ALLOC(p)    (GET(p) & 0x1)
+#define GET_ZEROED(p)   (GET(p) & ZEROED)
+#define GET_RELOC(p)    ((GET(p) & (RELOC | 0x1)) == (RELOC | 0x1))
+#define GET_GROWTH(p)   ((GET(p) & GROWTH_MASK) >> GROWTH_SHIFT)
 
 /* Given block ptr bp, compute address of its header and footer */
-#define HDRP(bp)        ((char *)(bp) - WSIZE)
-#define FTRP(bp)        ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
+#define HDRP(bp)        ((char *)(bp) - TSIZE)
+#define FTRP(bp)        ((char *)(bp) + GET_SIZE(HDRP(bp)) - 2*TSIZE)
 
 /* Given block ptr bp, compute address of next and previous blocks */
-#define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
-#define PREV_BLKP(bp) ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
+#define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(((char *)(bp) - TSIZE)))
+#define PREV_BLKP(bp) ((char *)(bp) - GET_SIZE(((char *)(bp) - 2*TSIZE)))
 
 /* Given block ptr bp, compute address of pointers to next and previous blocks */
 #define PREV_FREE_BLKP(bp)  ((char*)bp)
-#define NEXT_FREE_BLKP(bp)  ((char*)bp + WSIZE)
+#define NEXT_FREE_BLKP(bp)  ((char*)bp + TSIZE)
+
+/* Read and write the free block pointer stored at address p. In the compact
+   mode it is kept as a signed offset from heap_base in DSIZE units, 0 being
+   NULL (heap_base itself is padding, never a block). */
+#ifdef COMPACT_LINKS
+#define GET_LINK(p)     (GET(p) ? (char *)heap_base + (ptrdiff_t)(int32_t)GET(p) * DSIZE : NULL)
+#define PUT_LINK(p,bp)  PUT(p, (bp) ? (int32_t)(((char *)(bp) - (char *)heap_base) / DSIZE) : 0)
+#else
+#define GET_LINK(p)     ((char *)GET(p))
+#define PUT_LINK(p,bp)  PUT(p, (uintptr_t)(bp))
+#endif
+
+/* Heap segments: memlib_os.c can continue the heap in new, non-contiguous
+   segments, each with its own prologue and epilogue. memlib.o has only one. */
+#ifdef MEMLIB_OS
+#define HEAP_SEGMENTS()     mem_segments()
+#define SEGMENT_LO(i)       mem_segment_lo(i)
+#define SEGMENT_HI(i)       mem_segment_hi(i)
+#else
+#define HEAP_SEGMENTS()     1
+#define SEGMENT_LO(i)       mem_heap_lo()
+#define SEGMENT_HI(i)       mem_heap_hi()
+#endif
+/* One past the epilogue of the segment mem_sbrk() grows */
+#define HEAP_END()          ((char *)SEGMENT_HI(HEAP_SEGMENTS() - 1) + 1)
 
 /* Logging utility macros */
 #define LOGGING_LEVEL 0     // Max is 6.
+/* Heap checks after every operation: 0 none, 1 only the blocks and lists the
+   operation touched plus a full mm_check() every CHECK_INTERVAL operations,
+   2 a full mm_check() every time. A failed check aborts. */
+#ifndef CHECK_LEVEL
+#define CHECK_LEVEL 0
+#endif
+#ifndef CHECK_INTERVAL
+#define CHECK_INTERVAL 4096
+#endif
 #define logg(level, args ...)    if(level <= LOGGING_LEVEL){ printf(args); printf("\n"); fflush(stdout);}
 
 /* Global heap pointer */
 void* heap_listp = NULL;
-// An array of free blocks organized by sizes growed exponentially.
-void* free_block_lists[NUM_OF_FREE_LISTS];
+// Start of the first segment, what compact free list links are relative to.
+void* heap_base = NULL;
+// An array of free blocks organized by sizes growed exponentially, one per lifetime class.
+void* free_block_lists[NUM_OF_HINTS][NUM_OF_FREE_LISTS];
+
+/* A handle: where its relocatable block currently is. Unused handles are
+   chained through bp. */
+struct mm_handle {
+    void *bp;
+};
+struct mm_handle *free_handles = NULL;
+
+/* Side index of a bin: the sizes and pointers of (up to INDEX_SIZE of) its free
+   blocks, in no particular order. Blocks that did not fit are only on the list.
+   The last bin, whose sizes are unbounded, has no index. */
+typedef struct {
+    uint32_t size[INDEX_SIZE];
+    void *bp[INDEX_SIZE];
+    int n;              // entries in use
+    int overflow;       // blocks of the bin that are not in the index
+} bin_index_t;
+bin_index_t bin_index[NUM_OF_HINTS][NUM_OF_FREE_LISTS - 1];
+// Best fit scan over an index, picked by mm_init() for the CPU.
+int (*index_fit)(const uint32_t *size, int n, size_t asize);
+// Where mm_compact() resumes: a block of segment compact_seg, NULL to restart.
+char *compact_cursor = NULL;
+int compact_seg = 0;
+// Smallest mm_realloc() move that copy_large() does, 0 for none (mm_large_copy()).
+size_t large_copy_min = LARGE_COPY;
+// Smallest copy that copy_large() does with non-temporal stores, set by mm_init().
+size_t nt_copy_min = NT_COPY_DEFAULT;
+// mremap() calls copy_large() made, over the life of the process (REMAP_LIMIT).
+long remaps = 0;
+// Set by mm_scavenge_defer(): coalesce() leaves page release to mm_scavenge().
+int release_deferred = 0;
+// Where mm_scavenge() resumes, like compact_cursor, and how many passes it made.
+char *scavenge_cursor = NULL;
+int scavenge_seg = 0;
+uintptr_t scavenge_pass = 0;
+
+/* The adaptive policy and what it is learned from. Counts are per size class
+   (block size / DSIZE) and cover the current window, except nfree. */
+struct {
+    size_t split_min;                   // smallest remainder place() splits off
+    uint64_t pad;                       // bit c: blocks of class c get DSIZE more
+    uint32_t req[POLICY_CLASSES];       // requests, before padding
+    uint32_t rem[POLICY_CLASSES];       // remainders place() left inside a block
+    uint32_t miss[POLICY_CLASSES];      // heap grew while a block of this class was
+                                        // free and one DSIZE too small
+    uint32_t nfree[POLICY_CLASSES];     // free blocks right now
+    uint8_t idle[POLICY_CLASSES];       // windows a padded class went unused
+    unsigned long allocs;               // allocations in this window
+    unsigned long retunes;
+    unsigned long misses;
+} policy;
 
 
 /*******************************************************************************************
@@ -106,98 +369,235 @@ void logg_old(int level, char *arg, ...){
  * Print error message and return nonzero if the heap is consistant.
  *********************************************************/
 int mm_check(void){
-    int i = 0;
+    int h, i = 0;
     char *iter;
     int fail = 0;
+    uint32_t nfree[POLICY_CLASSES] = {0};
 
     // Iterate through the list of free blocks and check: 1) un-aligned blocks; 2) in-consistant
     // footer / header and 3) blocks that are not free.
-    for (i = 0; i<NUM_OF_FREE_LISTS; i++){
-        iter = free_block_lists[i];
-        while (iter!=NULL) {
+    for (h = 0; h<NUM_OF_HINTS && !fail; h++){
+        for (i = 0; i<NUM_OF_FREE_LISTS; i++){
+            iter = free_block_lists[h][i];
+            while (iter!=NULL) {
+                if ((size_t)iter%8){
+                    printf("FREEBLOCK ERROR: UN-ALIGNED BLOCK. bp: %p\n", iter);
+                    fail = 1;
+                    break;
+                }
+                if (GET(FTRP(iter)) != GET(HDRP(iter))) {
+                    printf("FREEBLOCK ERROR: INCONSISTANCY FOOTER / HEADER. index: %d; bp: %p; header: %zx; footer: %zx\n", i, iter, GET(HDRP(iter)), GET(FTRP(iter)));
+                    fail = 1;
+                    break;
+                }
+                if (GET_ALLOC(HDRP(iter))) {
+                    printf("FREEBLOCK ERROR: BLOCK NOT FREE. index: %d; bp: %p; header: %zx", i, iter, GET(HDRP(iter)));
+                    fail = 1;
+                    break;
+                }
+                if (GET_HINT(HDRP(iter)) != h) {
+                    printf("FREEBLOCK ERROR: BLOCK IN WRONG CLASS. class: %d; bp: %p; header: %zx\n", h, iter, GET(HDRP(iter)));
+                    fail = 1;
+                    break;
+                }
+                if (CLASS(GET_SIZE(HDRP(iter))) < POLICY_CLASSES)
+                    nfree[CLASS(GET_SIZE(HDRP(iter)))]++;
+                iter = GET_LINK(NEXT_FREE_BLKP(iter));
+            }
+        }
+    }
+    // The policy's count of free blocks per class must match the lists.
+    for (i = 0; i < POLICY_CLASSES && !fail; i++){
+        if (nfree[i] != policy.nfree[i]) {
+            printf("POLICY ERROR: FREE COUNT MISMATCH. class: %d; lists: %u; counted: %u\n", i, nfree[i], policy.nfree[i]);
+            fail = 1;
+        }
+    }
+    if (fail == 1){
+        printf("************** mm_check() FAILS!!!!!! ***********");
+        return 1;
+    }
+
+    // Check that every side index entry is a free block of its bin with the right size,
+    // and that the index and overflow count add up to the length of the list.
+    int n;
+    for (h = 0; h<NUM_OF_HINTS && !fail; h++){
+        for (i = 0; i<NUM_OF_FREE_LISTS - 1 && !fail; i++){
+            bin_index_t *idx = &bin_index[h][i];
+            for (n = 0; n < idx->n; n++){
+                if (GET_ALLOC(HDRP(idx->bp[n])) || !(GET(HDRP(idx->bp[n])) & INDEXED) || GET_SIZE(HDRP(idx->bp[n])) != idx->size[n]) {
+                    printf("INDEX ERROR: STALE ENTRY. index: %d; bp: %p; header: %zx; size: %x\n", i, idx->bp[n], GET(HDRP(idx->bp[n])), idx->size[n]);
+                    fail = 1;
+                    break;
+                }
+            }
+            for (n = 0, iter = free_block_lists[h][i]; iter != NULL; iter = GET_LINK(NEXT_FREE_BLKP(iter)))
+                n++;
+            if (n != idx->n + idx->overflow) {
+                printf("INDEX ERROR: COUNT MISMATCH. index: %d; list: %d; indexed: %d; overflow: %d\n", i, n, idx->n, idx->overflow);
+                fail = 1;
+            }
+        }
+    }
+    if (fail == 1){
+        printf("************** mm_check() FAILS!!!!!! ***********");
+        return 1;
+    }
+
+    // Iterate through every segment of the heap and check: 1) bp pointer actually lies inside the
+    // segment allocated using mem_sbrk(); 2) un-aligned blocks; 2) in-consistant footer / header;
+    // 3) relocatable blocks their handle has lost track of and 4) contiguour free blocks not coalesced.
+    int seg;
+    for (seg = 0; seg < HEAP_SEGMENTS() && !fail; seg++){
+        void* start_heap = SEGMENT_LO(seg);
+        void* end_heap = SEGMENT_HI(seg);
+        for (iter = (char *)start_heap + DSIZE; GET_SIZE(HDRP(iter)) > 0; iter=NEXT_BLKP(iter)){
+            if (iter < (char *)start_heap) {
+                printf("HEAP ERROR: BLOCK POINTER BEFORE START OF HEAP. bp: %p\n", iter);
+                fail = 1;
+                break;
+            }
+            if (iter > (char *)end_heap) {
+                printf("HEAP ERROR: BLOCK POINTER AFTER END OF HEAP. bp: %p\n", iter);
+                fail = 1;
+                break;
+            }
             if ((size_t)iter%8){
-                printf("FREEBLOCK ERROR: UN-ALIGNED BLOCK. bp: %p\n", iter);
+                printf("HEAP ERROR: UN-ALIGNED BLOCK. bp: %p\n", iter);
                 fail = 1;
                 break;
             }
             if (GET(FTRP(iter)) != GET(HDRP(iter))) {
-                printf("FREEBLOCK ERROR: INCONSISTANCY FOOTER / HEADER. index: %d; bp: %p; header: %zx; footer: %zx\n", i, iter, GET(HDRP(iter)), GET(FTRP(iter)));
+                printf("HEAP ERROR: INCONSISTANCY FOOTER / HEADER. bp: %p; header: %zx; footer: %zx\n", iter, GET(HDRP(iter)), GET(FTRP(iter)));
+                fail = 1;
+                break;
+            }
+            if (GET_RELOC(HDRP(iter)) && ((struct mm_handle *)GET_WORD(iter))->bp != iter) {
+                printf("HEAP ERROR: HANDLE DOES NOT POINT TO ITS BLOCK. bp: %p; handle: %zx\n", iter, GET_WORD(iter));
                 fail = 1;
                 break;
             }
-            if (GET_ALLOC(HDRP(iter))) {
-                printf("FREEBLOCK ERROR: BLOCK NOT FREE. index: %d; bp: %p; header: %zx", i, iter, GET(HDRP(iter)));
+            if (!GET_ALLOC(HDRP(iter)) && !GET_ALLOC(HDRP(NEXT_BLKP(iter))) && GET_HINT(HDRP(iter)) == GET_HINT(HDRP(NEXT_BLKP(iter)))) {
+                printf("HEAP ERROR: CONTIGUOUS FREE BLOCKS FOUND. bp: %p; header: %zx; bp.next: %p; bp.next.header: %zx\n", iter, GET(HDRP(iter)), NEXT_BLKP(iter), GET(HDRP(NEXT_BLKP(iter))));
                 fail = 1;
                 break;
             }
-            iter = (char *)GET(NEXT_FREE_BLKP(iter));
         }
     }
     if (fail == 1){
         printf("************** mm_check() FAILS!!!!!! ***********");
         return 1;
     }
+    return 0;
+}
 
-    // Iterate through the entire heap and check: 1) bp pointer actually lies inside the heap
-    // allocated using mem_sbrk(); 2) un-aligned blocks; 2) in-consistant footer / header;
-    // 3) free blocks that are not in the free list and 4) contiguour free blocks not coalesced.
-    void* start_heap = mem_heap_lo();
-    void* end_heap = mem_heap_hi();
-    for (iter = (char *)start_heap + DSIZE; GET_SIZE(HDRP(iter)) > 0; iter=NEXT_BLKP(iter)){
-        if (iter < (char *)start_heap) {
-            printf("HEAP ERROR: BLOCK POINTER BEFORE START OF HEAP. bp: %p\n", iter);
-            fail = 1;
-            break;
-        }
-        if (iter > (char *)end_heap) {
-            printf("HEAP ERROR: BLOCK POINTER AFTER END OF HEAP. bp: %p\n", iter);
-            fail = 1;
-            break;
-        }
-        if ((size_t)iter%8){
-            printf("HEAP ERROR: UN-ALIGNED BLOCK. bp: %p\n", iter);
-            fail = 1;
-            break;
-        }
-        if (GET(FTRP(iter)) != GET(HDRP(iter))) {
-            printf("HEAP ERROR: INCONSISTANCY FOOTER / HEADER. bp: %p; header: %zx; footer: %zx\n", iter, GET(HDRP(iter)), GET(FTRP(iter)));
-            fail = 1;
-            break;
-        }
-        if (!GET_ALLOC(HDRP(iter)) && !GET_ALLOC(HDRP(NEXT_BLKP(iter)))) {
-            printf("HEAP ERROR: CONTIGUOUS FREE BLOCKS FOUND. bp: %p; header: %zx; bp.next: %p; bp.next.header: %zx\n", iter, GET(HDRP(iter)), NEXT_BLKP(iter), GET(HDRP(NEXT_BLKP(iter))));
-            fail = 1;
-            break;
+/**********************************************************
+ * check_links
+ * Check that free block bp is linked into the list of its
+ * class and bin: its neighbours on the list point back to
+ * it, the list starts at it if it has no predecessor, and
+ * an INDEXED block is in its bin's index with its size.
+ * Return 1 (after printing why) if not.
+ **********************************************************/
+int check_links(void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+    int h = GET_HINT(HDRP(bp)), i = SIZE_BIN(size), n;
+    char *prev = GET_LINK(PREV_FREE_BLKP(bp)), *next = GET_LINK(NEXT_FREE_BLKP(bp));
+
+    if (prev == NULL ? free_block_lists[h][i] != bp : GET_LINK(NEXT_FREE_BLKP(prev)) != bp) {
+        printf("LIST ERROR: PREDECESSOR DOES NOT LEAD TO BLOCK. bp: %p; prev: %p; bin: %d\n", bp, prev, i);
+        return 1;
+    }
+    if (next != NULL && (GET_ALLOC(HDRP(next)) || GET_LINK(PREV_FREE_BLKP(next)) != bp)) {
+        printf("LIST ERROR: SUCCESSOR DOES NOT LEAD BACK TO BLOCK. bp: %p; next: %p\n", bp, next);
+        return 1;
+    }
+    if (GET(HDRP(bp)) & INDEXED) {
+        bin_index_t *idx = &bin_index[h][i];
+        for (n = 0; n < idx->n && idx->bp[n] != bp; n++)
+            ;
+        if (n == idx->n || idx->size[n] != size) {
+            printf("INDEX ERROR: INDEXED BLOCK MISSING. bp: %p; bin: %d\n", bp, i);
+            return 1;
         }
+    }
+    return 0;
+}
 
+/**********************************************************
+ * check_block
+ * The part of mm_check() that concerns block bp: its tags,
+ * alignment, its neighbours' tags, coalescing with them,
+ * and the list links of whichever of the three are free.
+ * Return 1 (after printing why) if anything is wrong.
+ **********************************************************/
+int check_block(void *bp)
+{
+    char *prev = PREV_BLKP(bp), *next = NEXT_BLKP(bp);
 
+    if ((uintptr_t)bp % DSIZE) {
+        printf("BLOCK ERROR: UN-ALIGNED BLOCK. bp: %p\n", bp);
+        return 1;
     }
-    if (fail == 1){
-        printf("************** mm_check() FAILS!!!!!! ***********");
+    if (GET(HDRP(bp)) != GET(FTRP(bp))
+            || GET(HDRP(prev)) != GET(FTRP(prev))
+            || (GET_SIZE(HDRP(next)) > 0 && GET(HDRP(next)) != GET(FTRP(next)))) {
+        printf("BLOCK ERROR: INCONSISTANCY FOOTER / HEADER AROUND. bp: %p; header: %zx; footer: %zx\n", bp, GET(HDRP(bp)), GET(FTRP(bp)));
+        return 1;
+    }
+    if (!GET_ALLOC(HDRP(bp))
+            && ((!GET_ALLOC(HDRP(prev)) && GET_HINT(HDRP(prev)) == GET_HINT(HDRP(bp)))
+             || (!GET_ALLOC(HDRP(next)) && GET_HINT(HDRP(next)) == GET_HINT(HDRP(bp))))) {
+        printf("BLOCK ERROR: FREE BLOCK NOT COALESCED. bp: %p; header: %zx\n", bp, GET(HDRP(bp)));
         return 1;
     }
+    if ((!GET_ALLOC(HDRP(bp)) && check_links(bp))
+            || (!GET_ALLOC(HDRP(prev)) && check_links(prev))
+            || (!GET_ALLOC(HDRP(next)) && check_links(next)))
+        return 1;
     return 0;
 }
 
+/**********************************************************
+ * check_op
+ * Run the checks CHECK_LEVEL asks for after operation op,
+ * which left block bp (NULL for none) behind. Abort if one
+ * fails.
+ **********************************************************/
+void check_op(const char *op, void *bp)
+{
+    static unsigned long ops = 0;
+
+    if ((CHECK_LEVEL == 1 && bp != NULL && check_block(bp))
+            || ((CHECK_LEVEL > 1 || ++ops % CHECK_INTERVAL == 0) && mm_check())) {
+        printf("\n%s() left a bad heap. bp: %p\n", op, bp);
+        fflush(stdout);
+        abort();
+    }
+}
+
 /**********************************************************
  * print_free_lists
  * Iterates through the array of free blocks with different sizes.
- * Print the list of free blocks at each index.
+ * Print the list of free blocks at each index of every class.
  *********************************************************/
 void print_free_lists(){
-    int i = 0;
+    int h, i = 0;
     char *iter;
     printf("========== The free block lists ==========\n");
-    for (i = 0; i<NUM_OF_FREE_LISTS; i++){
-        iter = free_block_lists[i];
-        printf("%d: ", i);
-        while (iter!=NULL) {
-            printf("%p(header:%zx;size:%zx)\t", iter, GET(HDRP(iter)), GET_SIZE(HDRP(iter)));
-            iter = (char *)GET(NEXT_FREE_BLKP(iter));
-            if (iter!=NULL)
-                printf("%p\t", iter);
+    for (h = 0; h<NUM_OF_HINTS; h++){
+        for (i = 0; i<NUM_OF_FREE_LISTS; i++){
+            iter = free_block_lists[h][i];
+            printf("%d.%d: ", h, i);
+            while (iter!=NULL) {
+                printf("%p(header:%zx;size:%zx)\t", iter, GET(HDRP(iter)), GET_SIZE(HDRP(iter)));
+                iter = GET_LINK(NEXT_FREE_BLKP(iter));
+                if (iter!=NULL)
+                    printf("%p\t", iter);
+            }
+            printf("\n");
         }
-        printf("\n");
     }
 }
 
@@ -211,26 +611,44 @@ void print_free_lists(){
 /**********************************************************
  * add_free_block
  * utility function that inserts the bp block to the
- * linkedlist of free blocks.
+ * linkedlist of free blocks of its lifetime class.
  *********************************************************/
 void add_free_block(void *bp){
     logg(4, "============ add_free_block() starts ==============");
+    void **lists = free_block_lists[GET_HINT(HDRP(bp))];
 
-    // Find the proper index to insert the block.
+    // Find the proper index to insert the block. Blocks larger than the last
+    // bin's bound (possible once the heap is backed by real OS memory) all go
+    // into the last bin.
     int free_list_i = 0;
-    int size = GET_SIZE(HDRP(bp));
-    while (size > (1 << (free_list_i))){
+    size_t size = GET_SIZE(HDRP(bp));
+    while (free_list_i < NUM_OF_FREE_LISTS - 1 && size > ((size_t)1 << (free_list_i))){
         free_list_i++;
     }
 
     // Add block from bp to the linkedlist of free_block_lists.
-    if (free_block_lists[free_list_i])
-        PUT(PREV_FREE_BLKP(free_block_lists[free_list_i]), (uintptr_t)bp);
-    PUT(NEXT_FREE_BLKP(bp), (uintptr_t)free_block_lists[free_list_i]);
-    PUT(PREV_FREE_BLKP(bp), (uintptr_t)NULL);
-    free_block_lists[free_list_i]=bp;
+    if (lists[free_list_i])
+        PUT_LINK(PREV_FREE_BLKP(lists[free_list_i]), bp);
+    PUT_LINK(NEXT_FREE_BLKP(bp), lists[free_list_i]);
+    PUT_LINK(PREV_FREE_BLKP(bp), NULL);
+    lists[free_list_i]=bp;
+    if (CLASS(size) < POLICY_CLASSES)
+        policy.nfree[CLASS(size)]++;
 
-    logg(5, "free_list_i is: %d; size is: %d; bp is: %p", free_list_i, size, bp);
+    // Index it too, if there is room.
+    if (free_list_i < NUM_OF_FREE_LISTS - 1) {
+        bin_index_t *idx = &bin_index[GET_HINT(HDRP(bp))][free_list_i];
+        if (idx->n < INDEX_SIZE) {
+            idx->size[idx->n] = size;
+            idx->bp[idx->n++] = bp;
+            PUT(HDRP(bp), GET(HDRP(bp)) | INDEXED);
+            PUT(FTRP(bp), GET(FTRP(bp)) | INDEXED);
+        } else {
+            idx->overflow++;
+        }
+    }
+
+    logg(5, "free_list_i is: %d; size is: %zu; bp is: %p", free_list_i, size, bp);
     logg(5, "next of bp is: %zx; prev of bp is: %zx", GET(NEXT_FREE_BLKP(bp)), GET(PREV_FREE_BLKP(bp)));
     logg(4, "============ add_free_block() ends ==============");
     return;
@@ -244,43 +662,91 @@ void add_free_block(void *bp){
 void remove_free_block(void *bp){
     logg(4, "============ remove_free_block() starts ==============");
     logg(5, "bp: %p;prev blk ptr: %zx;next blk ptr: %zx", bp, GET(PREV_FREE_BLKP(bp)), GET(NEXT_FREE_BLKP(bp)));
+    void **lists = free_block_lists[GET_HINT(HDRP(bp))];
 
     // Find the proper index where the block should locates.
     int free_list_i = 0;
-    int size = GET_SIZE(HDRP(bp));
-    while (size > (1 << (free_list_i))){
+    size_t size = GET_SIZE(HDRP(bp));
+    while (free_list_i < NUM_OF_FREE_LISTS - 1 && size > ((size_t)1 << (free_list_i))){
         free_list_i++;
     }
 
     // Remove the block from the doubly-linked linkedlist.
-    char *next_block_ptr = (char *)GET(NEXT_FREE_BLKP(bp));
-    char *prev_block_ptr = (char *)GET(PREV_FREE_BLKP(bp));
+    char *next_block_ptr = GET_LINK(NEXT_FREE_BLKP(bp));
+    char *prev_block_ptr = GET_LINK(PREV_FREE_BLKP(bp));
     // Case for only one free block
     if (!GET(PREV_FREE_BLKP(bp)) && !GET(NEXT_FREE_BLKP(bp))){
         logg(5, "Case A: block is the only free block in the list");
-        free_block_lists[free_list_i] = NULL;
+        lists[free_list_i] = NULL;
     }
     // Case where bp is the first free block
     else if (!GET(PREV_FREE_BLKP(bp)) && GET(NEXT_FREE_BLKP(bp))){
         logg(5, "Case B: block is the first free block in the list");
-        PUT(PREV_FREE_BLKP(next_block_ptr), (uintptr_t)NULL);
-        free_block_lists[free_list_i] = next_block_ptr;
+        PUT_LINK(PREV_FREE_BLKP(next_block_ptr), NULL);
+        lists[free_list_i] = next_block_ptr;
     }
     // Case where bp is the last free block
     else if (GET(PREV_FREE_BLKP(bp)) && !GET(NEXT_FREE_BLKP(bp))){
         logg(5, "Case C: block is the last free block in the list");
-        PUT(NEXT_FREE_BLKP(prev_block_ptr), (uintptr_t)NULL);
+        PUT_LINK(NEXT_FREE_BLKP(prev_block_ptr), NULL);
     }
     // Case where free blocks exist both before and after bp.
     else {
         logg(5, "Case D: free block exists in both directions");
-        PUT(NEXT_FREE_BLKP(prev_block_ptr), (uintptr_t)NULL);
-        PUT(PREV_FREE_BLKP(next_block_ptr), (uintptr_t)NULL);
+        PUT_LINK(NEXT_FREE_BLKP(prev_block_ptr), next_block_ptr);
+        PUT_LINK(PREV_FREE_BLKP(next_block_ptr), prev_block_ptr);
+    }
+    if (CLASS(size) < POLICY_CLASSES)
+        policy.nfree[CLASS(size)]--;
+
+    // Take it out of the index, moving the last entry into its place.
+    if (free_list_i < NUM_OF_FREE_LISTS - 1) {
+        bin_index_t *idx = &bin_index[GET_HINT(HDRP(bp))][free_list_i];
+        int i;
+        if (GET(HDRP(bp)) & INDEXED) {
+            for (i = 0; idx->bp[i] != bp; i++)
+                ;
+            idx->n--;
+            idx->size[i] = idx->size[idx->n];
+            idx->bp[i] = idx->bp[idx->n];
+            PUT(HDRP(bp), GET(HDRP(bp)) & ~INDEXED);
+            PUT(FTRP(bp), GET(FTRP(bp)) & ~INDEXED);
+        } else {
+            idx->overflow--;
+        }
     }
     logg(4, "============ remove_free_block() ends ==============");
     return;
 }
 
+/**********************************************************
+ * release_pages
+ * Give the whole pages of free block bp's interior that
+ * overlap [dirty_lo, dirty_hi) back to the OS, and mark bp
+ * as ZEROED. The header, link words and footer stay intact.
+ * Return the number of bytes released.
+ **********************************************************/
+size_t release_pages(void *bp, char *dirty_lo, char *dirty_hi)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+    char *lo = PAGE_UP((char *)bp + 2*TSIZE);
+    char *hi = PAGE_DOWN(FTRP(bp));
+
+    if (PAGE_DOWN(dirty_lo) > lo)
+        lo = PAGE_DOWN(dirty_lo);
+    if (PAGE_UP(dirty_hi) < hi)
+        hi = PAGE_UP(dirty_hi);
+    if (lo < hi) {
+        logg(2, "release_pages() releases %p-%p of bp: %p", lo, hi, bp);
+        TRACE_EVENT(MM_EV_RELEASE, bp, hi - lo, SIZE_BIN(GET_SIZE(HDRP(bp))), 0);
+        madvise(lo, hi - lo, MADV_DONTNEED);
+    }
+    size_t flags = GET(HDRP(bp)) & (HINT_MASK | INDEXED);
+    PUT(HDRP(bp), PACK(size, ZEROED | flags));
+    PUT(FTRP(bp), PACK(size, ZEROED | flags));
+    return lo < hi ? hi - lo : 0;
+}
+
 /**********************************************************
  * coalesce
  * Covers the 4 cases discussed in the text:
@@ -288,15 +754,23 @@ void remove_free_block(void *bp){
  * - the next block is available for coalescing
  * - the previous block is available for coalescing
  * - both neighbours are available for coalescing
+ * Neighbours of another lifetime class count as allocated.
+ * Large results have their interior pages released; pages
+ * of ZEROED neighbours that were not touched are skipped.
  **********************************************************/
 void *coalesce(void *bp)
 {
     logg(4, "============ coalesce() starts ==============");
     logg(1, "coalesce() called with bp: %p; Previous block: %p header: %zx; Next block: %p header: %zx", bp, PREV_BLKP(bp), GET(HDRP(PREV_BLKP(bp))), NEXT_BLKP(bp), GET(HDRP(NEXT_BLKP(bp))));
 
-    size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
-    size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+    size_t hint = GET(HDRP(bp)) & HINT_MASK;
+    size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp))) || (GET(FTRP(PREV_BLKP(bp))) & HINT_MASK) != hint;
+    size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp))) || (GET(HDRP(NEXT_BLKP(bp))) & HINT_MASK) != hint;
     size_t size = GET_SIZE(HDRP(bp));
+    // What can be dirty after merging: bp itself plus the neighbours' boundary
+    // tags and link words, unless a neighbour was not ZEROED to begin with.
+    char *dirty_lo = (!prev_alloc && GET_ZEROED(FTRP(PREV_BLKP(bp)))) ? HDRP(bp) - TSIZE : NULL;
+    char *dirty_hi = (!next_alloc && GET_ZEROED(HDRP(NEXT_BLKP(bp)))) ? NEXT_BLKP(bp) + 2*TSIZE : NULL;
 
     if (prev_alloc && next_alloc) {       /* Case 1 */
         logg(2, "Case 1: Both prev and next blocks are allocated. NO coalescing.");
@@ -305,16 +779,16 @@ void *coalesce(void *bp)
         logg(2, "Case2: Next block is free.");
         size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
         remove_free_block(NEXT_BLKP(bp));
-        PUT(HDRP(bp), PACK(size, 0));
-        PUT(FTRP(bp), PACK(size, 0));
+        PUT(HDRP(bp), PACK(size, hint));
+        PUT(FTRP(bp), PACK(size, hint));
     }
     else if (!prev_alloc && next_alloc) { /* Case 3 */
         logg(2, "Case3: Prev block is free.");
         size += GET_SIZE(HDRP(PREV_BLKP(bp)));
         remove_free_block(PREV_BLKP(bp));
         bp = PREV_BLKP(bp);     // move bp one block ahead
-        PUT(HDRP(bp), PACK(size, 0));
-        PUT(FTRP(bp), PACK(size, 0));
+        PUT(HDRP(bp), PACK(size, hint));
+        PUT(FTRP(bp), PACK(size, hint));
     }
     else {            /* Case 4 */
         logg(2, "Case4: Both blocks are free.");
@@ -322,76 +796,310 @@ void *coalesce(void *bp)
         remove_free_block(NEXT_BLKP(bp));
         remove_free_block(PREV_BLKP(bp));
         bp = PREV_BLKP(bp);
-        PUT(HDRP(bp), PACK(size,0));
-        PUT(FTRP(bp), PACK(size,0));
+        PUT(HDRP(bp), PACK(size, hint));
+        PUT(FTRP(bp), PACK(size, hint));
     }
 
+    // Don't leave mm_compact() pointing into the middle of the merged block.
+    if (compact_cursor > (char *)bp && compact_cursor < NEXT_BLKP(bp))
+        compact_cursor = bp;
+    if (scavenge_cursor > (char *)bp && scavenge_cursor < NEXT_BLKP(bp))
+        scavenge_cursor = bp;
+    // The block holds memory freed just now: a SCAVENGE_STAMP left in its
+    // first words (by a merged neighbour, or from before it was allocated)
+    // must not make mm_scavenge() take it for cold.
+    if (RELEASE_THRESHOLD && size >= 4*TSIZE + WSIZE)
+        PUT_WORD((char *)bp + 2*TSIZE, 0);
+
+    if (RELEASE_THRESHOLD && !release_deferred && size >= RELEASE_THRESHOLD)
+        release_pages(bp, dirty_lo ? dirty_lo : HDRP(bp), dirty_hi ? dirty_hi : FTRP(bp) + TSIZE);
+
     // Add the bp block to the beginning of free list of corresponding size.
     add_free_block(bp);
     logg(4, "============ coalesce() ends ==============");
     return bp;
 }
 
+/**********************************************************
+ * init_segment
+ * Lay down the alignment padding, prologue and epilogue at
+ * the start of the segment that mem_sbrk() grows.
+ * Return the prologue block pointer, or NULL if the heap
+ * cannot be extended.
+ **********************************************************/
+void *init_segment(void)
+{
+    char *p;
+
+    if ((p = mem_sbrk(4*WSIZE)) == (void *)-1)
+        return NULL;
+    memset(p, 0, DSIZE - TSIZE);                // alignment padding
+    PUT(p + DSIZE - TSIZE, PACK(DSIZE, 1));     // prologue header
+    PUT(p + 2*DSIZE - 2*TSIZE, PACK(DSIZE, 1)); // prologue footer
+    PUT(p + 2*DSIZE - TSIZE, PACK(0, 1));       // epilogue header
+    return p + DSIZE;
+}
+
 /**********************************************************
  * extend_heap
  * Extend the heap by "words" words, maintaining alignment
  * requirements of course. Free the former epilogue block
- * and reallocate its new header
+ * and reallocate its new header. If the current segment is
+ * full, the heap continues in a new segment. The new free
+ * block belongs to lifetime class hint.
  **********************************************************/
-void *extend_heap(size_t words)
+void *extend_heap(size_t words, int hint)
 {
     char *bp;
     size_t size;
 
     /* Allocate an even number of words to maintain alignments */
     size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
-    if ( (bp = mem_sbrk(size)) == (void *)-1 )
+    // Compact links only reach 32 GB around heap_base, so that mode keeps to
+    // the first segment (see MEMLIB_MAX_HEAP).
+    if ( (bp = mem_sbrk(size)) == (void *)-1 ) {
+#if defined(MEMLIB_OS) && !defined(COMPACT_LINKS)
+        if (mem_new_segment(size + 4*WSIZE) == (void *)-1 || init_segment() == NULL)
+            return NULL;
+        logg(1, "extend_heap starts heap segment %d", mem_segments() - 1);
+        if ( (bp = mem_sbrk(size)) == (void *)-1 )
+            return NULL;
+#else
         return NULL;
+#endif
+    }
 
     logg(1, "extend_heap extends words: %zx(h)(size: %zx(h)); new bp: %p", words, size, bp);
     /* Initialize free block header/footer and the epilogue header */
-    PUT(HDRP(bp), PACK(size, 0));                // free block header
-    PUT(FTRP(bp), PACK(size, 0));                // free block footer
+    PUT(HDRP(bp), PACK(size, FRESH | HINT_BITS(hint)));  // free block header
+    PUT(FTRP(bp), PACK(size, FRESH | HINT_BITS(hint)));  // free block footer
     PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));        // new epilogue header
     add_free_block(bp);
+    TRACE_EVENT(MM_EV_EXTEND, bp, size, SIZE_BIN(size), 0);
     return bp;
 }
 
+/**********************************************************
+ * index_fit_scalar
+ * Return the position of the smallest of the n sizes that
+ * is at least asize, or -1 if none is.
+ **********************************************************/
+int index_fit_scalar(const uint32_t *size, int n, size_t asize)
+{
+    int i, best = -1;
+
+    for (i = 0; i < n; i++)
+        if (size[i] >= asize && (best < 0 || size[i] < size[best]))
+            best = i;
+    return best;
+}
+
+#ifdef __SSE2__
+/* Indexed sizes are below 1<<29, so signed 32-bit compares are safe. After the
+   vector pass finds the smallest fitting size, a scalar pass finds where it is. */
+
+/**********************************************************
+ * index_fit_sse2
+ * index_fit_scalar() four sizes at a time. SSE2 has no
+ * 32-bit min, so it is done with a compare and a select.
+ **********************************************************/
+int index_fit_sse2(const uint32_t *size, int n, size_t asize)
+{
+    __m128i want = _mm_set1_epi32((int)asize - 1);
+    __m128i best = _mm_set1_epi32(INT32_MAX);
+    __m128i s, better;
+    int32_t lanes[4];
+    int32_t min = INT32_MAX;
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        s = _mm_loadu_si128((const __m128i *)(size + i));
+        // Take the lanes that fit and are smaller than the best so far.
+        better = _mm_and_si128(_mm_cmpgt_epi32(s, want), _mm_cmplt_epi32(s, best));
+        best = _mm_or_si128(_mm_and_si128(better, s), _mm_andnot_si128(better, best));
+    }
+    _mm_storeu_si128((__m128i *)lanes, best);
+    for (; i < n; i++)
+        if (size[i] >= asize && (int32_t)size[i] < min)
+            min = size[i];
+    for (i = 0; i < 4; i++)
+        if (lanes[i] < min)
+            min = lanes[i];
+
+    if (min == INT32_MAX)
+        return -1;
+    for (i = 0; size[i] != (uint32_t)min; i++)
+        ;
+    return i;
+}
+
+/**********************************************************
+ * index_fit_avx2
+ * index_fit_scalar() eight sizes at a time.
+ **********************************************************/
+__attribute__((target("avx2")))
+int index_fit_avx2(const uint32_t *size, int n, size_t asize)
+{
+    __m256i want = _mm256_set1_epi32((int)asize - 1);
+    __m256i none = _mm256_set1_epi32(INT32_MAX);
+    __m256i best = none;
+    __m256i s;
+    int32_t lanes[8];
+    int32_t min = INT32_MAX;
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        s = _mm256_loadu_si256((const __m256i *)(size + i));
+        s = _mm256_blendv_epi8(none, s, _mm256_cmpgt_epi32(s, want));
+        best = _mm256_min_epi32(best, s);
+    }
+    _mm256_storeu_si256((__m256i *)lanes, best);
+    for (; i < n; i++)
+        if (size[i] >= asize && (int32_t)size[i] < min)
+            min = size[i];
+    for (i = 0; i < 8; i++)
+        if (lanes[i] < min)
+            min = lanes[i];
+
+    if (min == INT32_MAX)
+        return -1;
+    for (i = 0; size[i] != (uint32_t)min; i++)
+        ;
+    return i;
+}
+#endif
+
 /**********************************************************
  * find_fit
- * Traverse the heap searching for a block to fit asize
+ * Search the bins of lifetime class hint, smallest first,
+ * for a block to fit asize: the best fit among the indexed
+ * blocks of the first bin that has one, else the first fit
+ * among the first LIMIT blocks on the list of a bin with
+ * blocks the index missed.
  * Return NULL if no free blocks can handle that size
  * Assumed that asize is aligned
  **********************************************************/
-void * find_fit(size_t asize)
+void * find_fit(size_t asize, int hint)
 {
-    void *bp, *smallest_bp = (void *)NULL;
-    int free_list_i=0;
-    int count = 0;
-    size_t smallest_bp_size = (size_t)-1;   // set to max size_t
+    void *bp;
+    int free_list_i, i;
+    int count;
     for (free_list_i = 1; free_list_i<NUM_OF_FREE_LISTS; free_list_i++){
-        if ((1<<(free_list_i))<asize){
+        if ((free_list_i < NUM_OF_FREE_LISTS - 1 && ((size_t)1<<(free_list_i))<asize)
+                || free_block_lists[hint][free_list_i] == NULL){
             continue;
         }
-        /* printf("free_list_i is: %d", free_list_i); */
-        bp = free_block_lists[free_list_i];
-        count = 0;
-        while (bp != NULL && count < LIMIT){
-            count ++;
-            if (asize <= GET_SIZE(HDRP(bp)) && GET_SIZE(HDRP(bp)) < smallest_bp_size){
-                logg(1, "find_fit() finds a fittable block at: %p for size: %zx(h)%zu(d)", bp, asize, asize);
-                /* return bp; */
-                smallest_bp = bp;
-                smallest_bp_size = GET_SIZE(HDRP(bp));
+        if (free_list_i < NUM_OF_FREE_LISTS - 1) {
+            bin_index_t *idx = &bin_index[hint][free_list_i];
+            if ((i = index_fit(idx->size, idx->n, asize)) >= 0) {
+                logg(1, "find_fit() finds a fittable block at: %p for size: %zx(h)%zu(d)", idx->bp[i], asize, asize);
+                return idx->bp[i];
             }
+            if (idx->overflow == 0)
+                continue;
+        }
+        bp = free_block_lists[hint][free_list_i];
+        for (count = 0; bp != NULL && count < LIMIT; count++, bp = GET_LINK(NEXT_FREE_BLKP(bp))){
+            if (asize <= GET_SIZE(HDRP(bp)))
+                return bp;
         }
-        if (smallest_bp!=NULL)
-            return smallest_bp;
     }
     logg(2, "find_fit() cannot find a free block with proper size: %zx(h)%zu(d).", asize, asize);
     return NULL;
 }
 
+/**********************************************************
+ * adjust_size
+ * Return the block size for a request of size bytes,
+ * including overhead and alignment.
+ **********************************************************/
+size_t adjust_size(size_t size)
+{
+    size_t asize;
+
+    asize = MAX(MIN_BLOCK, DSIZE * ((size + 2*TSIZE + (DSIZE-1))/ DSIZE));
+
+    // Pad the classes the policy says are better off one DSIZE bigger.
+    // Above the tracked classes, align the other way as binary-bal.rep likes.
+    if (CLASS(asize) < POLICY_CLASSES ? (policy.pad >> CLASS(asize)) & 1 : PADDED(asize))
+        asize += DSIZE;
+    return asize;
+}
+
+/**********************************************************
+ * retune_policy
+ * Set the policy for the next window from this one's
+ * histograms, then clear them:
+ * - a class is padded once it had POLICY_MISSES misses, and
+ *   stops being padded after POLICY_IDLE windows in which
+ *   it was requested but the class it is padded into was not.
+ *   Padding starts out on for classes of 64 bytes and up
+ *   that are a multiple of PAD_ROUND.
+ * - place() splits off the smallest remainder it left inside
+ *   a block that at least 1/16 of the requests would have
+ *   fit in, and never less than it does to begin with.
+ **********************************************************/
+void retune_policy(void)
+{
+    unsigned long fit = 0;
+    size_t c;
+
+    policy.split_min = SPLIT_DEFAULT;
+    for (c = 0; c < POLICY_CLASSES; c++) {
+        fit += policy.req[c];
+        if (policy.rem[c] > 0 && fit >= POLICY_WINDOW / 16 && c * DSIZE < policy.split_min)
+            policy.split_min = MAX(MIN_BLOCK, c * DSIZE);
+
+        if (policy.miss[c] >= POLICY_MISSES) {
+            policy.pad |= (uint64_t)1 << c;
+            policy.idle[c] = 0;
+        } else if (((policy.pad >> c) & 1) && policy.req[c] > 0) {
+            if (c + 1 < POLICY_CLASSES && policy.req[c + 1] > 0)
+                policy.idle[c] = 0;
+            else if (++policy.idle[c] >= POLICY_IDLE)
+                policy.pad &= ~((uint64_t)1 << c);
+        }
+    }
+    logg(1, "retune_policy() split_min: %zu; pad: %llx", policy.split_min, (unsigned long long)policy.pad);
+
+    memset(policy.req, 0, sizeof(policy.req));
+    memset(policy.rem, 0, sizeof(policy.rem));
+    memset(policy.miss, 0, sizeof(policy.miss));
+    policy.allocs = 0;
+    policy.retunes++;
+}
+
+/**********************************************************
+ * note_request
+ * Count a request of size bytes for the policy, and retune
+ * it once a window is full.
+ **********************************************************/
+void note_request(size_t size)
+{
+    size_t c = CLASS(MAX(MIN_BLOCK, DSIZE * ((size + 2*TSIZE + (DSIZE-1))/ DSIZE)));
+
+    if (c < POLICY_CLASSES)
+        policy.req[c]++;
+    if (++policy.allocs == POLICY_WINDOW)
+        retune_policy();
+}
+
+/**********************************************************
+ * note_miss
+ * The heap is about to grow for a block of asize bytes.
+ * If a free block one DSIZE smaller was there, blocks of
+ * that class would have been reused had they been padded.
+ **********************************************************/
+void note_miss(size_t asize)
+{
+    size_t c = CLASS(asize) - 1;
+
+    if (c < POLICY_CLASSES && policy.nfree[c] > 0) {
+        policy.miss[c]++;
+        policy.misses++;
+    }
+}
+
 /**********************************************************
  * place
  * Mark the block as allocated.
@@ -402,48 +1110,215 @@ void place(void* bp, size_t asize)
     remove_free_block(bp);
     /* Get the current block size */
     size_t bsize = GET_SIZE(HDRP(bp));
+    size_t zeroed = GET_ZEROED(HDRP(bp));
+    size_t hint = GET(HDRP(bp)) & HINT_MASK;
 
     // Create a block of the size difference and insert it into the free list.
-    if (bsize - asize > 8*DSIZE) {
-        PUT(HDRP(bp), PACK(asize, 1));
-        PUT(FTRP(bp), PACK(asize, 1));
-        PUT(HDRP(NEXT_BLKP(bp)), PACK(bsize-asize, 0));
-        PUT(FTRP(NEXT_BLKP(bp)), PACK(bsize-asize, 0));
+    // The remainder's interior pages lie inside bp's, so it stays ZEROED.
+    if (bsize - asize >= policy.split_min) {
+        PUT(HDRP(bp), PACK(asize, 1 | hint));
+        PUT(FTRP(bp), PACK(asize, 1 | hint));
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(bsize-asize, zeroed | hint));
+        PUT(FTRP(NEXT_BLKP(bp)), PACK(bsize-asize, zeroed | hint));
         add_free_block(NEXT_BLKP(bp));
     } else {
-        PUT(HDRP(bp), PACK(bsize, 1));
-        PUT(FTRP(bp), PACK(bsize, 1));
+        PUT(HDRP(bp), PACK(bsize, 1 | hint));
+        PUT(FTRP(bp), PACK(bsize, 1 | hint));
+        if (CLASS(bsize - asize) < POLICY_CLASSES)
+            policy.rem[CLASS(bsize - asize)]++;
     }
 }
 
 
+/**********************************************************
+ * find_block
+ * The free block an allocation of asize bytes in lifetime
+ * class hint goes into, not yet placed: the best fit from
+ * the class's free lists, or new memory from extend_heap()
+ * if no free block fits.
+ **********************************************************/
+void *find_block(size_t asize, int hint)
+{
+    char *bp;
+
+    if (asize > MAX_BLOCK)
+        return NULL;
+    if ((bp = find_fit(asize, hint)) == NULL) {
+        /* No fit found. Get more memory */
+        note_miss(asize);
+        bp = extend_heap(MAX(asize, hint ? HINT_CHUNKSIZE : CHUNKSIZE)/WSIZE, hint);
+    }
+    return bp;
+}
+
+/**********************************************************
+ * alloc_block
+ * Allocate a block of asize bytes in lifetime class hint:
+ * find_block(), then place() the block in it.
+ **********************************************************/
+void *alloc_block(size_t asize, int hint)
+{
+    char *bp;
+
+    if ((bp = find_block(asize, hint)) == NULL)
+        return NULL;
+    place(bp, asize);
+    return bp;
+}
+
+/**********************************************************
+ * slide_block
+ * Move the relocatable block bp down into the free block
+ * right before it and update its handle. The free space
+ * now lies after the block and is coalesced with whatever
+ * follows. Return the resulting free block.
+ **********************************************************/
+void *slide_block(void *bp)
+{
+    char *dst = PREV_BLKP(bp);
+    size_t bsize = GET_SIZE(HDRP(bp));
+    size_t fsize = GET_SIZE(HDRP(dst));
+    size_t hint = GET(HDRP(bp)) & HINT_MASK;
+    logg(2, "slide_block() moves bp: %p to %p", bp, dst);
+
+    remove_free_block(dst);
+    memmove(dst, bp, bsize - 2*TSIZE);
+    PUT(HDRP(dst), PACK(bsize, 1 | RELOC | hint));
+    PUT(FTRP(dst), PACK(bsize, 1 | RELOC | hint));
+    ((struct mm_handle *)GET_WORD(dst))->bp = dst;
+    if (scavenge_cursor == bp)
+        scavenge_cursor = dst;
+    TRACE_EVENT(MM_EV_MOVE, dst, bsize, SIZE_BIN(bsize), bp);
+
+    PUT(HDRP(NEXT_BLKP(dst)), PACK(fsize, hint));
+    PUT(FTRP(NEXT_BLKP(dst)), PACK(fsize, hint));
+    return coalesce(NEXT_BLKP(dst));
+}
+
+/**********************************************************
+ * copy_nt
+ * memcpy() with non-temporal stores: the destination does
+ * not displace the cache, and the source is prefetched
+ * for a single use.
+ **********************************************************/
+void copy_nt(char *dst, const char *src, size_t n)
+{
+#ifdef __SSE2__
+    size_t head = -(uintptr_t)dst & 15;
+
+    if (n < head + 64) {
+        memcpy(dst, src, n);
+        return;
+    }
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    n -= head;
+    for (; n >= 64; n -= 64, dst += 64, src += 64) {
+        __m128i a, b, c, d;
+        _mm_prefetch(src + NT_PREFETCH, _MM_HINT_NTA);
+        a = _mm_loadu_si128((const __m128i *)src);
+        b = _mm_loadu_si128((const __m128i *)(src + 16));
+        c = _mm_loadu_si128((const __m128i *)(src + 32));
+        d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)dst, a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+    _mm_sfence();
+#endif
+    memcpy(dst, src, n);
+}
+
+/**********************************************************
+ * copy_large
+ * Copy the n byte payload of a block being moved from src
+ * to dst. If both lie at the same offset in a page, the
+ * whole pages in between are moved with mremap(), which
+ * leaves zero pages behind at src, until REMAP_LIMIT
+ * remaps have been made. Otherwise copies too big for the
+ * cache go through copy_nt().
+ **********************************************************/
+void copy_large(char *dst, char *src, size_t n)
+{
+#if REMAP_PAGES && defined(MREMAP_DONTUNMAP)
+    size_t page = mem_pagesize();
+    char *lo = (char *)(((uintptr_t)src + page - 1) & ~(uintptr_t)(page - 1));
+    char *hi = (char *)(((uintptr_t)src + n) & ~(uintptr_t)(page - 1));
+
+    if (n >= REMAP_MIN && remaps < REMAP_LIMIT && !mem_hugepagesize()
+            && (uintptr_t)(dst - src) % page == 0 && lo < hi
+            && mremap(lo, hi - lo, hi - lo, MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP,
+                      dst + (lo - src)) != MAP_FAILED) {
+        remaps++;
+        logg(2, "copy_large() remaps %p-%p to %p", lo, hi, dst + (lo - src));
+        memcpy(dst, src, lo - src);
+        memcpy(dst + (hi - src), hi, src + n - hi);
+        return;
+    }
+#endif
+    if (n >= nt_copy_min)
+        copy_nt(dst, src, n);
+    else
+        memcpy(dst, src, n);
+}
+
+
 /*******************************************************************************************
 ********************************************************************************************
 ***************************************** MAIN FUNCTIONS ***********************************
 ********************************************************************************************
 *******************************************************************************************/
 
+/**********************************************************
+ * pick_cpu_paths
+ * Pick the widest best fit scan the CPU can run, and the
+ * copy size that would not fit in its last level cache.
+ **********************************************************/
+void pick_cpu_paths(void)
+{
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+
+    index_fit = index_fit_scalar;
+#ifdef __SSE2__
+    index_fit = __builtin_cpu_supports("avx2") ? index_fit_avx2 : index_fit_sse2;
+#endif
+    nt_copy_min = llc > 0 ? (size_t)llc / 4 * 3 : NT_COPY_DEFAULT;
+}
+
 /**********************************************************
  * mm_init
  * Initialize the heap, including "allocation" of the
  * prologue and epilogue. It allocates four words and
  * set the heap_listp pointer to the beginning of third word.
+ * (See init_segment())
  **********************************************************/
 int mm_init(void)
 {
     logg(1, "============ mm_init() starts ==============");
-    if ((heap_listp = mem_sbrk(4*WSIZE)) == (void *)-1)
+    if ((heap_listp = init_segment()) == NULL)
         return -1;
-    PUT(heap_listp, 0);                         // alignment padding
-    PUT(heap_listp + (1 * WSIZE), PACK(DSIZE, 1));   // prologue header
-    PUT(heap_listp + (2 * WSIZE), PACK(DSIZE, 1));   // prologue footer
-    PUT(heap_listp + (3 * WSIZE), PACK(0, 1));    // epilogue header
-    heap_listp += DSIZE;
+    heap_base = (char *)heap_listp - DSIZE;
     logg(1, "initial heap_listp: %p", heap_listp);
     // Initialize the segregated free lists.
-    int i;
-    for (i = 0; i < NUM_OF_FREE_LISTS; i++)
-        free_block_lists[i]=NULL;
+    int h, i;
+    for (h = 0; h < NUM_OF_HINTS; h++)
+        for (i = 0; i < NUM_OF_FREE_LISTS; i++)
+            free_block_lists[h][i]=NULL;
+    memset(bin_index, 0, sizeof(bin_index));
+
+    // Start the policy over with the default split and padding.
+    memset(&policy, 0, sizeof(policy));
+    policy.split_min = SPLIT_DEFAULT;
+    for (i = 4; i < POLICY_CLASSES; i++)
+        if (PADDED(i * DSIZE))
+            policy.pad |= (uint64_t)1 << i;
+    free_handles = NULL;
+    compact_cursor = NULL;
+    scavenge_cursor = NULL;
+
+    pick_cpu_paths();
     logg(3, "============ mm_init() ends ==============");
 
     return 0;
@@ -465,9 +1340,15 @@ void mm_free(void *bp)
 
     // Mark the current block as free and do coalescing.
     size_t size = GET_SIZE(HDRP(bp));
-    PUT(HDRP(bp), PACK(size,0));
-    PUT(FTRP(bp), PACK(size,0));
-    coalesce(bp);
+    size_t hint = GET(HDRP(bp)) & HINT_MASK;
+    if (PROF_ENABLED && (GET(HDRP(bp)) & SAMPLED))
+        PROF_FREE(bp);
+    PUT(HDRP(bp), PACK(size, hint));
+    PUT(FTRP(bp), PACK(size, hint));
+    TRACE_EVENT(MM_EV_FREE, bp, size, SIZE_BIN(size), 0);
+    bp = coalesce(bp);
+    if (CHECK_LEVEL > 0)
+        check_op("mm_free", bp);
 
     logg(3, "============ mm_free() ends ==============\n");
 }
@@ -481,42 +1362,53 @@ void mm_free(void *bp)
  * pointer of the free block and create a new free block from
  * the difference. (in place() utility function)
  * If no block satisfies the request, the heap is extended
+ * (see alloc_block()).
  **********************************************************/
 void *mm_malloc(size_t size)
+{
+    return mm_malloc_hint(size, MM_HINT_DEFAULT);
+}
+
+/**********************************************************
+ * mm_malloc_hint
+ * mm_malloc() for a block of the given lifetime class
+ * (MM_HINT_*). The block is carved from the class's own free
+ * lists and heap chunks. Unknown hints mean MM_HINT_DEFAULT.
+ **********************************************************/
+void *mm_malloc_hint(size_t size, int hint)
 {
     logg(3, "\n============ mm_malloc() starts ==============");
     if (LOGGING_LEVEL>0)
         mm_check();
     size_t asize; /* adjusted block size */
-    size_t extendsize; /* amount to extend heap if no fit */
     char * bp;
 
-    /* Ignore spurious requests */
-    if (size == 0)
+    /* Ignore spurious requests, and ones adjust_size() would wrap around */
+    if (size == 0 || size > MAX_BLOCK)
         return NULL;
 
+#ifdef MEMLIB_OS
+    // Huge page mode: start big blocks on a huge page boundary, so they are
+    // covered by as few huge pages as possible.
+    if (mem_hugepagesize() && size >= mem_hugepagesize() / 2)
+        return mm_memalign(mem_hugepagesize(), size);
+#endif
+
     /* Adjust block size to include overhead and alignment reqs. */
-    if (size <= DSIZE)
-        asize = 2 * DSIZE;
-    else
-        asize = DSIZE * ((size + (DSIZE) + (DSIZE-1))/ DSIZE);
+    note_request(size);
+    asize = adjust_size(size);
 
-    // Align it the other way to calibrate for binary-bal.rep.
-    if (asize % 32 == 0)
-        asize += DSIZE;
+    if (hint < 0 || hint >= NUM_OF_HINTS)
+        hint = MM_HINT_DEFAULT;
 
-    /* Search the free list for a fit */
-    if ((bp = find_fit(asize)) != NULL) {
-        place(bp, asize);
-        return bp;
-    }
-
-    /* No fit found. Get more memory and place the block */
-    extendsize = MAX(asize, CHUNKSIZE);
-    if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
+    /* Search the free list for a fit, extending the heap if there is none */
+    if ((bp = alloc_block(asize, hint)) == NULL)
         return NULL;
-    place(bp, asize);
     logg(1, "mm_malloc(%zx(h)%zu(d)) returns bp: %p; with actual size: %zx", size, size, bp, asize);
+    TRACE_EVENT(MM_EV_MALLOC, bp, size, SIZE_BIN(asize), hint);
+    PROF_MALLOC(bp, size);
+    if (CHECK_LEVEL > 0)
+        check_op("mm_malloc", bp);
     if (LOGGING_LEVEL>0)
         mm_check();
     logg(3, "============ mm_malloc() ends ==============\n");
@@ -524,14 +1416,194 @@ void *mm_malloc(size_t size)
 
 }
 
+/**********************************************************
+ * mm_calloc
+ * Allocate an array of nmemb elements of size bytes each
+ * and zero it. Returns NULL if the total size overflows.
+ * If the block came out of a ZEROED free block, only the
+ * bytes outside its released pages are cleared.
+ **********************************************************/
+void *mm_calloc(size_t nmemb, size_t size)
+{
+    size_t bytes, asize, zeroed;
+    char *bp, *lo, *hi;
+
+    if (size != 0 && nmemb > (size_t)-1 / size)
+        return NULL;
+    if ((bytes = nmemb * size) == 0 || bytes > MAX_BLOCK)
+        return NULL;
+
+#ifdef MEMLIB_OS
+    // Huge page mode puts big blocks on a huge page boundary, as mm_malloc() does.
+    if (mem_hugepagesize() && bytes >= mem_hugepagesize() / 2) {
+        if ((bp = mm_memalign(mem_hugepagesize(), bytes)) != NULL)
+            memset(bp, 0, bytes);
+        return bp;
+    }
+#endif
+
+    /* Same as mm_malloc(), but look at the block before it is placed. */
+    note_request(bytes);
+    asize = adjust_size(bytes);
+    if ((bp = find_block(asize, MM_HINT_DEFAULT)) == NULL)
+        return NULL;
+    zeroed = GET_ZEROED(HDRP(bp));
+    place(bp, asize);
+
+    lo = PAGE_UP(bp + 2*TSIZE);
+    hi = PAGE_DOWN(bp + bytes);
+    if (zeroed && lo < hi) {
+        logg(2, "mm_calloc() skips zero pages %p-%p of bp: %p", lo, hi, bp);
+        memset(bp, 0, lo - bp);
+        memset(hi, 0, bp + bytes - hi);
+    } else {
+        memset(bp, 0, bytes);
+    }
+    TRACE_EVENT(MM_EV_CALLOC, bp, bytes, SIZE_BIN(asize), 0);
+    PROF_MALLOC(bp, bytes);
+    if (CHECK_LEVEL > 0)
+        check_op("mm_calloc", bp);
+    return bp;
+}
+
+/**********************************************************
+ * mm_memalign
+ * Allocate a block whose payload is aligned to alignment
+ * (a power of two). Over-allocates so that an aligned payload
+ * with room for a leading free block always exists, then
+ * gives the leading part and any unused tail back to the
+ * free lists.
+ **********************************************************/
+void *mm_memalign(size_t alignment, size_t size)
+{
+    char *bp, *abp;
+    size_t asize, bsize, lead;
+
+    if (size > MAX_BLOCK || alignment > MAX_BLOCK)
+        return NULL;
+    // Every payload is already DSIZE aligned.
+    if (alignment <= DSIZE)
+        return mm_malloc(size);
+
+    if ((bp = alloc_block(adjust_size(size + alignment + 2*DSIZE), MM_HINT_DEFAULT)) == NULL)
+        return NULL;
+
+    // The leading part must be big enough to be a free block on its own.
+    if ((uintptr_t)bp % alignment != 0) {
+        abp = (char *)(((uintptr_t)bp + 2*DSIZE + alignment - 1) & ~(uintptr_t)(alignment - 1));
+        bsize = GET_SIZE(HDRP(bp));
+        lead = abp - bp;
+        logg(2, "mm_memalign() splits bp: %p at abp: %p; lead: %zx", bp, abp, lead);
+
+        PUT(HDRP(bp), PACK(lead, 0));
+        PUT(FTRP(bp), PACK(lead, 0));
+        PUT(HDRP(abp), PACK(bsize - lead, 1));
+        PUT(FTRP(abp), PACK(bsize - lead, 1));
+        coalesce(bp);
+        bp = abp;
+    }
+
+    // Give the unused tail back too, using the same rule as place().
+    asize = adjust_size(size);
+    bsize = GET_SIZE(HDRP(bp));
+    if (bsize >= asize + policy.split_min) {
+        PUT(HDRP(bp), PACK(asize, 1));
+        PUT(FTRP(bp), PACK(asize, 1));
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(bsize - asize, 0));
+        PUT(FTRP(NEXT_BLKP(bp)), PACK(bsize - asize, 0));
+        coalesce(NEXT_BLKP(bp));
+    }
+    TRACE_EVENT(MM_EV_MEMALIGN, bp, size, SIZE_BIN(GET_SIZE(HDRP(bp))), alignment);
+    PROF_MALLOC(bp, size);
+    if (CHECK_LEVEL > 0)
+        check_op("mm_memalign", bp);
+    return bp;
+}
+
+/**********************************************************
+ * mm_malloc_flags
+ * mm_malloc() with MM_* flags. MM_CACHELINE_ISOLATED gives
+ * the payload whole cache lines: it is line aligned and
+ * rounded up to a line, and only tags lie on either side.
+ * mm_memalign() leaves the space up to the line boundary
+ * as a free block, and any tail that holds a free block is
+ * split off, so neither is lost.
+ **********************************************************/
+void *mm_malloc_flags(size_t size, int flags)
+{
+    size_t asize, bsize, tags;
+    char *bp;
+
+    if (!(flags & MM_CACHELINE_ISOLATED))
+        return mm_malloc(size);
+    if (size == 0 || size > MAX_BLOCK)
+        return NULL;
+
+    if ((bp = mm_memalign(CACHELINE, LINE_UP(size))) == NULL)
+        return NULL;
+
+    // mm_memalign() keeps any tail place() would not split off, up to
+    // policy.split_min bytes. Only the footer has to follow the last line,
+    // so give back every tail that holds a free block.
+    asize = DSIZE * ((LINE_UP(size) + 2*TSIZE + (DSIZE-1)) / DSIZE);
+    bsize = GET_SIZE(HDRP(bp));
+    tags = GET(HDRP(bp)) & ~MAX_BLOCK;
+    if (bsize >= asize + MIN_BLOCK) {
+        PUT(HDRP(bp), PACK(asize, tags));
+        PUT(FTRP(bp), PACK(asize, tags));
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(bsize - asize, 0));
+        PUT(FTRP(NEXT_BLKP(bp)), PACK(bsize - asize, 0));
+        coalesce(NEXT_BLKP(bp));
+    }
+    PUT(HDRP(bp), GET(HDRP(bp)) | ISOLATED);
+    PUT(FTRP(bp), GET(FTRP(bp)) | ISOLATED);
+    if (CHECK_LEVEL > 0)
+        check_op("mm_malloc_flags", bp);
+    return bp;
+}
+
+/**********************************************************
+ * mm_usable_size
+ * Return the number of payload bytes available in the
+ * allocated block bp.
+ **********************************************************/
+size_t mm_usable_size(void *bp)
+{
+    if (bp == NULL)
+        return 0;
+    return GET_SIZE(HDRP(bp)) - 2*TSIZE;
+}
+
+/**********************************************************
+ * mm_policy_stats
+ * Report the split threshold and padding the policy is
+ * using, and what it has learned so far.
+ **********************************************************/
+void mm_policy_stats(mm_policy_stats_t *stats)
+{
+    size_t c;
+
+    stats->split_min = policy.split_min;
+    stats->pad = policy.pad;
+    stats->retunes = policy.retunes;
+    stats->misses = policy.misses;
+    stats->unsplit_bytes = 0;
+    for (c = 0; c < POLICY_CLASSES; c++)
+        stats->unsplit_bytes += (size_t)policy.rem[c] * c * DSIZE;
+}
+
 /**********************************************************
  * mm_realloc
- * If the size is smaller than the original block, simply
- * return the original block.
+ * If the size fits in the original block, return the
+ * original block, giving back its tail if it shrank to half
+ * or less.
  * If the block is at the end of the heap, extend the heap
  * to the required size and return. (This is a calibraion
  * for realloc-bal.rep)
- * Otherwise, simply call mm_free() and mm_malloc().
+ * Otherwise, simply call mm_free() and mm_malloc(), keeping
+ * the block's lifetime class. A block that has to be moved
+ * again to grow gets half again as much room as asked for
+ * (up to GROWTH_MAX), so growing it is mostly done in place.
  *********************************************************/
 void *mm_realloc(void *ptr, size_t size)
 {
@@ -543,6 +1615,9 @@ void *mm_realloc(void *ptr, size_t size)
       mm_free(ptr);
       return NULL;
     }
+    /* Too big for a block: the size computations below would wrap. */
+    if (size > MAX_BLOCK)
+      return NULL;
     /* If oldptr is NULL, then this is just malloc. */
     if (ptr == NULL)
       return (mm_malloc(size));
@@ -550,48 +1625,506 @@ void *mm_realloc(void *ptr, size_t size)
     // If we can fit the new size into the old block, do it!
     void *oldptr = ptr;
     void *newptr;
-    size_t copySize;
+    size_t copySize, roomSize;
     size_t oldSize = GET_SIZE(HDRP(oldptr));
+    size_t flags = GET(HDRP(oldptr)) & (HINT_MASK | GROWTH_MASK | SAMPLED | ISOLATED);
+    size_t growth = GET_GROWTH(HDRP(oldptr));
+    size_t lsize = (flags & ISOLATED) ? LINE_UP(size) : size;   // an isolated block keeps whole lines
     size_t asize;
-    if (size <= DSIZE)
+    if (lsize <= DSIZE)
         asize = 2 * DSIZE;
     else
-        asize = DSIZE * ((size + (DSIZE) + (DSIZE-1))/ DSIZE);
+        asize = DSIZE * ((lsize + 2*TSIZE + (DSIZE-1))/ DSIZE);
     asize += DSIZE;     // For the prev / next free block.
     if (asize < oldSize) {
         logg(2, "Old pointer is enough. bp: %p; oldSize: %zx; newSize: %zx", oldptr, oldSize, asize);
+        // A real shrink (not slack left by growing it) gives the tail back.
+        asize = adjust_size(lsize);
+        if (asize <= oldSize / 2 && oldSize - asize >= policy.split_min) {
+            logg(2, "Shrinking. bp: %p; oldSize: %zx; newSize: %zx", oldptr, oldSize, asize);
+            PUT(HDRP(oldptr), PACK(asize, 1 | (flags & (HINT_MASK | SAMPLED | ISOLATED))));
+            PUT(FTRP(oldptr), PACK(asize, 1 | (flags & (HINT_MASK | SAMPLED | ISOLATED))));
+            PUT(HDRP(NEXT_BLKP(oldptr)), PACK(oldSize - asize, flags & HINT_MASK));
+            PUT(FTRP(NEXT_BLKP(oldptr)), PACK(oldSize - asize, flags & HINT_MASK));
+            coalesce(NEXT_BLKP(oldptr));
+        }
+        TRACE_EVENT(MM_EV_REALLOC, oldptr, size, SIZE_BIN(GET_SIZE(HDRP(oldptr))), oldptr);
+        if (CHECK_LEVEL > 0)
+            check_op("mm_realloc", oldptr);
         logg(3, "============ mm_realloc() ends ==============\n");
         return oldptr;
     }
 
-    // Extend the heap if it's the last element. Calibaration for realloc-bal.rep trace.
-    if (GET_SIZE(HDRP(NEXT_BLKP(oldptr))) == 0){
-        mm_check();
+    // Extend the heap if it's the last element of the segment mem_sbrk() grows.
+    // Calibaration for realloc-bal.rep trace.
+    if ((char *)NEXT_BLKP(oldptr) == HEAP_END() && asize <= MAX_BLOCK){
+        if (LOGGING_LEVEL>0)
+            mm_check();
         logg(2, "Last block, will extend the heap. bp: %p; oldSize: %zx; newSize: %zx", oldptr, oldSize, asize);
         size_t words = asize / WSIZE;
         asize = (words%2) ? (words+1) * WSIZE : words * WSIZE;
-        void *bp;
 
-        if ( (bp = mem_sbrk(asize-oldSize)) == (void *)-1 )
-            return NULL;
-        PUT(HDRP(oldptr), PACK(asize, 1));
-        PUT(FTRP(oldptr), PACK(asize, 1));
-        PUT(HDRP(NEXT_BLKP(oldptr)), PACK(0, 1));
-        mm_check();
-        logg(3, "============ mm_realloc() ends ==============\n");
-        return oldptr;
+        // If the segment is full, fall back to moving the block.
+        if (mem_sbrk(asize-oldSize) != (void *)-1) {
+            PUT(HDRP(oldptr), PACK(asize, 1 | flags));
+            PUT(FTRP(oldptr), PACK(asize, 1 | flags));
+            PUT(HDRP(NEXT_BLKP(oldptr)), PACK(0, 1));
+            if (LOGGING_LEVEL>0)
+                mm_check();
+            TRACE_EVENT(MM_EV_REALLOC, oldptr, size, SIZE_BIN(asize), oldptr);
+            if (CHECK_LEVEL > 0)
+                check_op("mm_realloc", oldptr);
+            logg(3, "============ mm_realloc() ends ==============\n");
+            return oldptr;
+        }
     }
 
-    newptr = mm_malloc(size);
-    if (newptr == NULL)
+    // The block has been moved to grow before: give it room to grow into.
+    // A large one of the default class goes on a page boundary for copy_large().
+    TRACE_MUTE();
+    copySize = oldSize - 2*TSIZE;
+    if (size < copySize)
+      copySize = size;
+    roomSize = growth > 0 ? size + MIN(size / 2, GROWTH_MAX) : size;
+    if (flags & ISOLATED)
+        newptr = mm_malloc_flags(roomSize, MM_CACHELINE_ISOLATED);
+    else if (REMAP_PAGES && large_copy_min && copySize >= large_copy_min && remaps < REMAP_LIMIT
+            && GET_HINT(HDRP(oldptr)) == MM_HINT_DEFAULT)
+        newptr = mm_memalign(mem_pagesize(), roomSize);
+    else
+        newptr = mm_malloc_hint(roomSize, GET_HINT(HDRP(oldptr)));
+    if (newptr == NULL) {
+      TRACE_UNMUTE();
       return NULL;
+    }
+    if (growth < 7)
+        growth++;
+    PUT(HDRP(newptr), GET(HDRP(newptr)) | GROWTH_BITS(growth));
+    PUT(FTRP(newptr), GET(FTRP(newptr)) | GROWTH_BITS(growth));
+    logg(2, "Moved to grow. bp: %p; newptr: %p; growth: %zu", oldptr, newptr, growth);
 
     /* Copy the old data. */
-    copySize = GET_SIZE(HDRP(oldptr));
-    if (size < copySize)
-      copySize = size;
-    memcpy(newptr, oldptr, copySize);
+    if (large_copy_min && copySize >= large_copy_min)
+        copy_large(newptr, oldptr, copySize);
+    else
+        memcpy(newptr, oldptr, copySize);
     mm_free(oldptr);
+    TRACE_UNMUTE();
+    TRACE_EVENT(MM_EV_REALLOC, newptr, size, SIZE_BIN(GET_SIZE(HDRP(newptr))), oldptr);
+    if (CHECK_LEVEL > 0)
+        check_op("mm_realloc", newptr);
     logg(3, "============ mm_realloc() ends ==============\n");
     return newptr;
 }
+
+/**********************************************************
+ * mm_halloc
+ * Allocate a relocatable block of size bytes and return its
+ * handle, or NULL. The payload is only reachable through
+ * mm_hlock(), and may move whenever it is not locked. The
+ * blocks are kept in the MM_HINT_LONG class, together with
+ * other long-lived data.
+ **********************************************************/
+mm_handle_t mm_halloc(size_t size)
+{
+    struct mm_handle *h;
+    char *bp;
+    int i;
+
+    if (size == 0 || size > MAX_BLOCK)
+        return NULL;
+
+    // Handles never move, so they come in chunks from the default class.
+    if (free_handles == NULL) {
+        if ((h = alloc_block(adjust_size(HANDLE_CHUNK * sizeof(struct mm_handle)), MM_HINT_DEFAULT)) == NULL)
+            return NULL;
+        for (i = 0; i < HANDLE_CHUNK; i++) {
+            h[i].bp = free_handles;
+            free_handles = &h[i];
+        }
+    }
+
+    if ((bp = alloc_block(adjust_size(size + DSIZE), MM_HINT_LONG)) == NULL)
+        return NULL;
+    h = free_handles;
+    free_handles = h->bp;
+    h->bp = bp;
+
+    PUT(HDRP(bp), GET(HDRP(bp)) | RELOC);
+    PUT(FTRP(bp), GET(FTRP(bp)) | RELOC);
+    PUT_WORD(bp, (uintptr_t)h);     // the handle, for mm_compact()
+    PUT_WORD(bp + WSIZE, 0);        // lock count
+    logg(1, "mm_halloc(%zu) returns handle: %p; bp: %p", size, h, bp);
+    return h;
+}
+
+/**********************************************************
+ * mm_hlock
+ * Pin the block of handle h and return its payload. Locks
+ * nest; the block may move again once every mm_hlock() has
+ * been matched by mm_hunlock().
+ **********************************************************/
+void *mm_hlock(mm_handle_t h)
+{
+    char *bp;
+
+    if (h == NULL)
+        return NULL;
+    bp = h->bp;
+    PUT_WORD(bp + WSIZE, GET_WORD(bp + WSIZE) + 1);
+    return bp + DSIZE;
+}
+
+/**********************************************************
+ * mm_hunlock
+ * Undo one mm_hlock() of handle h. Pointers to the payload
+ * must not be used after the last unlock.
+ **********************************************************/
+void mm_hunlock(mm_handle_t h)
+{
+    char *bp;
+
+    if (h == NULL)
+        return;
+    bp = h->bp;
+    if (GET_WORD(bp + WSIZE) > 0)
+        PUT_WORD(bp + WSIZE, GET_WORD(bp + WSIZE) - 1);
+}
+
+/**********************************************************
+ * mm_hfree
+ * Free the block of handle h and the handle itself.
+ **********************************************************/
+void mm_hfree(mm_handle_t h)
+{
+    if (h == NULL)
+        return;
+    mm_free(h->bp);
+    h->bp = free_handles;
+    free_handles = h;
+}
+
+/**********************************************************
+ * mm_compact
+ * Walk the heap from where the last call stopped and slide
+ * every unlocked relocatable block that follows a free block
+ * of its class down into it, until budget_us microseconds
+ * have passed or the end of the heap is reached; the next
+ * call then starts over from the bottom.
+ * Return the number of bytes moved.
+ **********************************************************/
+size_t mm_compact(long budget_us)
+{
+    struct timespec start, now;
+    size_t moved = 0;
+    int walked = 0;
+    char *bp;
+
+    if (heap_listp == NULL)
+        return 0;
+    if (compact_cursor == NULL) {
+        compact_seg = 0;
+        compact_cursor = heap_listp;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (bp = compact_cursor; ; bp = NEXT_BLKP(bp)) {
+        // At an epilogue, go on with the next segment's prologue.
+        if (GET_SIZE(HDRP(bp)) == 0) {
+            if (++compact_seg == HEAP_SEGMENTS())
+                break;
+            bp = (char *)SEGMENT_LO(compact_seg) + DSIZE;
+            continue;
+        }
+
+        if (GET_RELOC(HDRP(bp)) && GET_WORD(bp + WSIZE) == 0
+                && !GET_ALLOC(FTRP(PREV_BLKP(bp)))
+                && (GET(FTRP(PREV_BLKP(bp))) & HINT_MASK) == (GET(HDRP(bp)) & HINT_MASK)) {
+            moved += GET_SIZE(HDRP(bp)) - 2*TSIZE;
+            bp = slide_block(bp);
+            walked = COMPACT_CHECK;
+        }
+
+        if (++walked >= COMPACT_CHECK) {
+            walked = 0;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000 >= budget_us) {
+                compact_cursor = bp;
+                logg(2, "mm_compact() moved %zu bytes, stops at bp: %p", moved, bp);
+                return moved;
+            }
+        }
+    }
+
+    compact_cursor = NULL;
+    logg(2, "mm_compact() moved %zu bytes, reached the end of the heap", moved);
+    return moved;
+}
+
+/**********************************************************
+ * mm_scavenge_defer
+ * With defer set, freeing a large block no longer releases
+ * its pages right away; mm_scavenge() does it later.
+ **********************************************************/
+void mm_scavenge_defer(int defer)
+{
+    release_deferred = defer;
+}
+
+/**********************************************************
+ * mm_scavenge
+ * Walk the heap from where the last call stopped and give
+ * back the pages of the free blocks that are cold, i.e.
+ * were already free when the previous pass walked past
+ * them, and of the free block at the end of the heap, until
+ * budget_us microseconds have passed or the end of the heap
+ * is reached. Add the bytes released to *released (if not
+ * NULL). Return 1 if the pass is over, so that the next call
+ * starts a new one from the bottom, 0 if the budget ran out.
+ **********************************************************/
+int mm_scavenge(long budget_us, size_t *released)
+{
+    struct timespec start, now;
+    size_t bytes = 0;
+    int walked = 0;
+    char *bp;
+
+    if (heap_listp == NULL || !RELEASE_THRESHOLD)
+        return 1;
+    if (scavenge_cursor == NULL) {
+        scavenge_seg = 0;
+        scavenge_cursor = heap_listp;
+        scavenge_pass++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (bp = scavenge_cursor; ; bp = NEXT_BLKP(bp)) {
+        if (GET_SIZE(HDRP(bp)) == 0) {
+            if (++scavenge_seg == HEAP_SEGMENTS())
+                break;
+            bp = (char *)SEGMENT_LO(scavenge_seg) + DSIZE;
+            continue;
+        }
+
+        // Only free blocks with a whole page inside that is not released yet.
+        if (!GET_ALLOC(HDRP(bp)) && !GET_ZEROED(HDRP(bp))
+                && PAGE_UP((char *)bp + 2*TSIZE + WSIZE) < PAGE_DOWN(FTRP(bp))) {
+            if (GET_WORD(bp + 2*TSIZE) == SCAVENGE_STAMP(scavenge_pass - 1) || NEXT_BLKP(bp) == HEAP_END()) {
+                bytes += release_pages(bp, HDRP(bp), FTRP(bp) + TSIZE);
+                walked = COMPACT_CHECK;
+            } else {
+                PUT_WORD(bp + 2*TSIZE, SCAVENGE_STAMP(scavenge_pass));
+            }
+        }
+
+        if (++walked >= COMPACT_CHECK) {
+            walked = 0;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000 >= budget_us) {
+                scavenge_cursor = bp;
+                logg(2, "mm_scavenge() released %zu bytes, stops at bp: %p", bytes, bp);
+                if (released != NULL)
+                    *released += bytes;
+                return 0;
+            }
+        }
+    }
+
+    scavenge_cursor = NULL;
+    logg(2, "mm_scavenge() released %zu bytes, reached the end of the heap", bytes);
+    if (released != NULL)
+        *released += bytes;
+    return 1;
+}
+
+/**********************************************************
+ * mm_large_copy
+ * Set the smallest mm_realloc() move that goes through
+ * copy_large(); 0 copies every move with memcpy().
+ * Return the previous setting.
+ **********************************************************/
+size_t mm_large_copy(size_t min_bytes)
+{
+    size_t old = large_copy_min;
+
+    large_copy_min = min_bytes;
+    return old;
+}
+
+/* A snapshot's header and segment entries (see SNAPSHOT_MAGIC) */
+typedef struct {
+    char magic[8];
+    uint32_t tsize, num_lists, index_size, globals_size;
+    int32_t segments;
+    uint64_t root;          /* the pointer handed to mm_snapshot() */
+} snapshot_header_t;
+
+typedef struct {
+    uint64_t start, reserved, size;
+} snapshot_segment_t;
+
+/* The globals a snapshot keeps; the CPU dependent ones are picked again. */
+static const struct {
+    void *p;
+    size_t size;
+} snapshot_globals[] = {
+    { &heap_listp, sizeof(heap_listp) },
+    { &heap_base, sizeof(heap_base) },
+    { free_block_lists, sizeof(free_block_lists) },
+    { &free_handles, sizeof(free_handles) },
+    { bin_index, sizeof(bin_index) },
+    { &compact_cursor, sizeof(compact_cursor) },
+    { &compact_seg, sizeof(compact_seg) },
+    { &scavenge_cursor, sizeof(scavenge_cursor) },
+    { &scavenge_seg, sizeof(scavenge_seg) },
+    { &scavenge_pass, sizeof(scavenge_pass) },
+    { &policy, sizeof(policy) },
+};
+#define SNAPSHOT_GLOBALS (int)(sizeof(snapshot_globals) / sizeof(snapshot_globals[0]))
+
+/**********************************************************
+ * snapshot_header
+ * Fill in the header of a snapshot of this build.
+ **********************************************************/
+void snapshot_header(snapshot_header_t *hdr)
+{
+    int i;
+
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic));
+    hdr->tsize = TSIZE;
+    hdr->num_lists = NUM_OF_FREE_LISTS;
+    hdr->index_size = INDEX_SIZE;
+    for (i = 0; i < SNAPSHOT_GLOBALS; i++)
+        hdr->globals_size += snapshot_globals[i].size;
+}
+
+/**********************************************************
+ * snapshot_io
+ * read(2) or write(2) all of the len bytes at buf; -1 on
+ * error or end of file.
+ **********************************************************/
+int snapshot_io(int fd, void *buf, size_t len, int writing)
+{
+    char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = writing ? write(fd, p, len) : read(fd, p, len)) <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+#ifdef MEMLIB_OS
+/**********************************************************
+ * mm_snapshot
+ * Write the whole heap and the allocator's state to path,
+ * for mm_restore() to start from, along with root: where
+ * the program will find its data. Return -1 on error.
+ **********************************************************/
+int mm_snapshot(const char *path, void *root)
+{
+    snapshot_header_t hdr;
+    snapshot_segment_t seg;
+    int fd, i;
+
+    if (heap_listp == NULL || HEAP_SEGMENTS() > SNAPSHOT_SEGMENTS)
+        return -1;
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -1;
+
+    snapshot_header(&hdr);
+    hdr.segments = HEAP_SEGMENTS();
+    hdr.root = (uintptr_t)root;
+    if (snapshot_io(fd, &hdr, sizeof(hdr), 1) < 0)
+        goto fail;
+    for (i = 0; i < HEAP_SEGMENTS(); i++) {
+        seg.start = (uintptr_t)SEGMENT_LO(i);
+        seg.reserved = mem_segment_reserved(i);
+        seg.size = (char *)SEGMENT_HI(i) + 1 - (char *)SEGMENT_LO(i);
+        if (snapshot_io(fd, &seg, sizeof(seg), 1) < 0)
+            goto fail;
+    }
+    for (i = 0; i < SNAPSHOT_GLOBALS; i++)
+        if (snapshot_io(fd, snapshot_globals[i].p, snapshot_globals[i].size, 1) < 0)
+            goto fail;
+    for (i = 0; i < HEAP_SEGMENTS(); i++)
+        if (snapshot_io(fd, SEGMENT_LO(i), (char *)SEGMENT_HI(i) + 1 - (char *)SEGMENT_LO(i), 1) < 0)
+            goto fail;
+    logg(1, "mm_snapshot() wrote %d segments to %s", HEAP_SEGMENTS(), path);
+    return close(fd);
+
+fail:
+    close(fd);
+    return -1;
+}
+
+/**********************************************************
+ * mm_restore
+ * Replace the heap with the snapshot at path, at the same
+ * addresses, check it and set *root to the root it was
+ * taken with. Every pointer into the old heap is lost. If
+ * the snapshot is of another build, its address ranges are
+ * taken, or it fails mm_check(), start over with an empty
+ * heap and return -1.
+ **********************************************************/
+int mm_restore(const char *path, void **root)
+{
+    snapshot_header_t hdr, want;
+    snapshot_segment_t seg[SNAPSHOT_SEGMENTS];
+    int fd, i;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    snapshot_header(&want);
+    if (snapshot_io(fd, &hdr, sizeof(hdr), 0) < 0 || hdr.segments < 1 || hdr.segments > SNAPSHOT_SEGMENTS
+            || memcmp(&hdr, &want, offsetof(snapshot_header_t, segments)) != 0
+            || snapshot_io(fd, seg, hdr.segments * sizeof(seg[0]), 0) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    mem_deinit();
+    for (i = 0; i < hdr.segments; i++)
+        if (mem_restore_segment((void *)(uintptr_t)seg[i].start, seg[i].reserved, seg[i].size) < 0)
+            goto fail;
+    for (i = 0; i < SNAPSHOT_GLOBALS; i++)
+        if (snapshot_io(fd, snapshot_globals[i].p, snapshot_globals[i].size, 0) < 0)
+            goto fail;
+    for (i = 0; i < hdr.segments; i++)
+        if (snapshot_io(fd, (void *)(uintptr_t)seg[i].start, seg[i].size, 0) < 0)
+            goto fail;
+    close(fd);
+    pick_cpu_paths();
+
+    if (mm_check() != 0) {
+        logg(1, "mm_restore(): %s does not hold a consistent heap", path);
+        goto reset;
+    }
+    logg(1, "mm_restore() read %d segments from %s", hdr.segments, path);
+    *root = (void *)(uintptr_t)hdr.root;
+    return 0;
+
+fail:
+    close(fd);
+reset:
+    mem_deinit();
+    mem_init();
+    mm_init();
+    return -1;
+}
+#else
+/* The memlib.o sandbox is malloc'ed, and cannot be put back at an address. */
+int mm_snapshot(const char *path, void *root)
+{
+    return -1;
+}
+
+int mm_restore(const char *path, void **root)
+{
+    return -1;
+}
+#endif
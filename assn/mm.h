@@ -7,6 +7,62 @@ int mm_init(void);
 void *mm_malloc(size_t size);
 void mm_free(void *ptr);
 void *mm_realloc(void *ptr, size_t size);
+void *mm_calloc(size_t nmemb, size_t size);
+void *mm_memalign(size_t alignment, size_t size);
+size_t mm_usable_size(void *ptr);
+
+/* Lifetime hints for mm_malloc_hint(). Blocks of each class are kept apart. */
+#define MM_HINT_DEFAULT 0   /* unknown lifetime, same as mm_malloc() */
+#define MM_HINT_SHORT   1   /* freed soon after it is allocated */
+#define MM_HINT_LONG    2   /* lives for most of the program */
+#define MM_HINT_REQUEST 3   /* freed together with the rest of a request */
+void *mm_malloc_hint(size_t size, int hint);
+
+/* Flags for mm_malloc_flags() */
+#define MM_CACHELINE_ISOLATED 0x1   /* no other payload shares the block's cache lines */
+void *mm_malloc_flags(size_t size, int flags);
+
+/*
+ * Relocatable allocations. The block of a handle is only reachable through
+ * mm_hlock(), and mm_compact() may move it while it is not locked.
+ */
+typedef struct mm_handle *mm_handle_t;
+mm_handle_t mm_halloc(size_t size);
+void *mm_hlock(mm_handle_t h);
+void mm_hunlock(mm_handle_t h);
+void mm_hfree(mm_handle_t h);
+size_t mm_compact(long budget_us);
+
+/*
+ * Background page release. After mm_scavenge_defer(1), freeing a large block
+ * keeps its pages; mm_scavenge() gives back those of blocks that stay free.
+ */
+void mm_scavenge_defer(int defer);
+int mm_scavenge(long budget_us, size_t *released);
+
+/* Smallest mm_realloc() move that is remapped or copied around the cache
+   (default 256 KB), 0 for none. Returns the previous setting. */
+size_t mm_large_copy(size_t min_bytes);
+
+/*
+ * Heap snapshots (memlib_os.c heaps only): mm_snapshot() writes the heap, the
+ * allocator's state and a root pointer to a file, and mm_restore() replaces
+ * the heap with a copy of one, at the same addresses, and gives the root
+ * back. Pointers out of the heap only survive in the same binary and address
+ * layout. Both return -1 on error.
+ */
+int mm_snapshot(const char *path, void *root);
+int mm_restore(const char *path, void **root);
+
+/* What the adaptive split and padding policy is currently using. */
+typedef struct {
+    size_t split_min;           /* smallest remainder split off a free block */
+    unsigned long long pad;     /* bit c: blocks of c*16 bytes are padded by 16 */
+    unsigned long retunes;      /* times the policy was retuned */
+    unsigned long misses;       /* heap growths while a free block was 16 bytes short */
+    size_t unsplit_bytes;       /* remainders left inside blocks this window */
+} mm_policy_stats_t;
+void mm_policy_stats(mm_policy_stats_t *stats);
 
 /* 
  * Students work in teams of one or two.  Teams enter their team name, personal
@@ -0,0 +1,319 @@
+/*
+ * mm_prof.c - the sample tables behind PROF_SAMPLE() (see mm_prof.h).
+ *
+ * Call stacks and sampled blocks live in fixed-size open addressing
+ * tables, mmap'ed on the first sample since malloc may be the allocator
+ * being profiled. Samples that find a table full are dropped. A spinlock
+ * guards the tables; it is only taken once per sample, and by the
+ * mm_free() of a sampled block.
+ *
+ * backtrace() loads its unwinder, and so allocates, the first time it
+ * runs. That must not happen inside the allocator, where the LD_PRELOAD
+ * shim holds its lock, so a constructor calls it once at load time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+
+#include "mm_prof.h"
+
+#define SITES       (1 << 14)   /* distinct call stacks */
+#define SAMPLES     (1 << 16)   /* sampled blocks live at once */
+#define MAXLINE     1024
+
+/* Sampled bytes and blocks allocated from one call stack */
+typedef struct {
+    uint64_t hash;          /* 0 for an empty slot */
+    int depth;
+    void *pc[MM_PROF_DEPTH];
+    uint64_t live_count, live_bytes;
+    uint64_t alloc_count, alloc_bytes;
+} site_t;
+
+/* A sampled block that has not been freed */
+typedef struct {
+    void *bp;               /* NULL for an empty slot */
+    uint32_t site;
+    size_t size;
+} sample_t;
+
+__thread intptr_t mm_prof_countdown __attribute__((tls_model("initial-exec")));
+static __thread uint64_t rng __attribute__((tls_model("initial-exec")));
+static __thread int busy __attribute__((tls_model("initial-exec")));
+
+static site_t *sites = NULL;
+static sample_t *samples = NULL;
+static size_t num_sites = 0, num_samples = 0;   /* slots in use */
+static double rate = MM_PROF_RATE;
+static char lock = 0;
+
+static void prof_lock(void)
+{
+    while (__atomic_test_and_set(&lock, __ATOMIC_ACQUIRE))
+        ;
+}
+
+static void prof_unlock(void)
+{
+    __atomic_clear(&lock, __ATOMIC_RELEASE);
+}
+
+/*
+ * dump_at_exit - write the profile to MM_PROF_FILE
+ */
+static void dump_at_exit(void)
+{
+    char *path = getenv("MM_PROF_FILE");
+
+    if (path != NULL && mm_prof_dump(path) < 0)
+        fprintf(stderr, "mm_prof: could not write %s\n", path);
+}
+
+/*
+ * prof_register - runs at load time: read the settings, and get
+ *    backtrace() and atexit() to do their allocating now
+ */
+__attribute__((constructor)) static void prof_register(void)
+{
+    char *env = getenv("MM_PROF_RATE");
+    void *pc[1];
+
+    if (env != NULL && atof(env) >= 1)
+        rate = atof(env);
+    // Its loading the unwinder allocates, and must not sample: that would
+    // call backtrace() again inside the dlopen().
+    busy = 1;
+    backtrace(pc, 1);
+    busy = 0;
+    if (getenv("MM_PROF_FILE") != NULL)
+        atexit(dump_at_exit);
+}
+
+/*
+ * next_interval - bytes to the next sample: exponential with mean rate
+ */
+static intptr_t next_interval(void)
+{
+    double u;
+
+    if (rng == 0)
+        rng = (uintptr_t)&rng ^ 0x9e3779b97f4a7c15ULL;
+    // xorshift64*
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    u = ((rng * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+    return (intptr_t)(-log(1.0 - u) * rate) + 1;
+}
+
+static size_t sample_slot(void *bp)
+{
+    size_t i = ((uintptr_t)bp >> 4) * 0x9e3779b97f4a7c15ULL & (SAMPLES - 1);
+
+    while (samples[i].bp != NULL && samples[i].bp != bp)
+        i = (i + 1) & (SAMPLES - 1);
+    return i;
+}
+
+/*
+ * tables - the tables, mapped on first use. Call with the lock held.
+ */
+static int tables(void)
+{
+    void *p;
+
+    if (sites != NULL)
+        return 0;
+    p = mmap(NULL, SITES * sizeof(site_t) + SAMPLES * sizeof(sample_t), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    samples = (sample_t *)((site_t *)p + SITES);
+    sites = p;
+    return 0;
+}
+
+/*
+ * mm_prof_sample - PROF_DUE() said to sample the allocation of size bytes
+ *    at bp: record its call stack, and set the countdown to the next
+ *    sample. Returns 1 if bp is now in the live set and must be passed to
+ *    mm_prof_free() when it is freed, 0 if it was not sampled after all.
+ */
+int mm_prof_sample(void *bp, size_t size)
+{
+    void *pc[MM_PROF_DEPTH + 1];
+    uint64_t hash = 14695981039346656037ULL;
+    size_t s, i;
+    int depth, d, first = rng == 0;
+
+    mm_prof_countdown = next_interval();
+    // A thread's first countdown started at 0, not at a random draw.
+    if (first || busy)
+        return 0;
+
+    busy = 1;
+    depth = backtrace(pc, MM_PROF_DEPTH + 1) - 1;   // not this frame
+    busy = 0;
+    for (d = 0; d < depth; d++)
+        hash = (hash ^ (uintptr_t)pc[d + 1]) * 1099511628211ULL;
+    hash |= 1;
+
+    prof_lock();
+    if (tables() < 0) {
+        prof_unlock();
+        return 0;
+    }
+    // Both tables keep a quarter of their slots empty, so probes stay short.
+    for (i = hash & (SITES - 1); sites[i].hash != 0; i = (i + 1) & (SITES - 1))
+        if (sites[i].hash == hash && sites[i].depth == depth && memcmp(sites[i].pc, pc + 1, depth * sizeof(void *)) == 0)
+            break;
+    if (sites[i].hash == 0) {
+        if (num_sites >= SITES / 4 * 3) {
+            prof_unlock();
+            return 0;
+        }
+        num_sites++;
+        sites[i].hash = hash;
+        sites[i].depth = depth;
+        memcpy(sites[i].pc, pc + 1, depth * sizeof(void *));
+    }
+    sites[i].alloc_count++;
+    sites[i].alloc_bytes += size;
+
+    s = sample_slot(bp);
+    if (samples[s].bp == NULL) {
+        if (num_samples >= SAMPLES / 4 * 3) {
+            prof_unlock();
+            return 0;
+        }
+        num_samples++;
+    } else {
+        // Left over from a heap that mm_init() started over without freeing it.
+        sites[samples[s].site].live_count--;
+        sites[samples[s].site].live_bytes -= samples[s].size;
+    }
+    samples[s].bp = bp;
+    samples[s].site = i;
+    samples[s].size = size;
+    sites[i].live_count++;
+    sites[i].live_bytes += size;
+    prof_unlock();
+    return 1;
+}
+
+/*
+ * mm_prof_free - sampled block bp is being freed: take it out of the
+ *    live set
+ */
+void mm_prof_free(void *bp)
+{
+    size_t i, j, k;
+
+    prof_lock();
+    if (sites == NULL || samples[i = sample_slot(bp)].bp == NULL) {
+        prof_unlock();
+        return;
+    }
+    sites[samples[i].site].live_count--;
+    sites[samples[i].site].live_bytes -= samples[i].size;
+
+    // Remove slot i, moving back the entries that probed past it.
+    samples[i].bp = NULL;
+    num_samples--;
+    for (j = i;;) {
+        j = (j + 1) & (SAMPLES - 1);
+        if (samples[j].bp == NULL)
+            break;
+        k = ((uintptr_t)samples[j].bp >> 4) * 0x9e3779b97f4a7c15ULL & (SAMPLES - 1);
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            samples[i] = samples[j];
+            samples[j].bp = NULL;
+            i = j;
+        }
+    }
+    prof_unlock();
+}
+
+/*
+ * write_all - write(2) all of buf, -1 on error
+ */
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, p, len)) <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * mm_prof_dump - write the profile to path: a heap_v2 header with the
+ *    totals and the sampling rate, a line per call stack, and the memory
+ *    map pprof needs to symbolize the addresses. The counts are of
+ *    samples; pprof scales them by the rate. Returns -1 on error.
+ */
+__attribute__((visibility("default"))) int mm_prof_dump(const char *path)
+{
+    char line[MAXLINE + MM_PROF_DEPTH * 20];
+    uint64_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    int fd, maps, len, d;
+    ssize_t n;
+    size_t i;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -1;
+
+    // Anything allocated while the lock is held here must not be sampled.
+    busy = 1;
+    prof_lock();
+    for (i = 0; sites != NULL && i < SITES; i++) {
+        live_count += sites[i].live_count;
+        live_bytes += sites[i].live_bytes;
+        alloc_count += sites[i].alloc_count;
+        alloc_bytes += sites[i].alloc_bytes;
+    }
+    len = snprintf(line, sizeof(line), "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%.0f\n",
+                   (unsigned long long)live_count, (unsigned long long)live_bytes,
+                   (unsigned long long)alloc_count, (unsigned long long)alloc_bytes, rate);
+    if (write_all(fd, line, len) < 0)
+        goto fail;
+    for (i = 0; sites != NULL && i < SITES; i++) {
+        if (sites[i].hash == 0)
+            continue;
+        len = snprintf(line, sizeof(line), "%llu: %llu [%llu: %llu] @",
+                       (unsigned long long)sites[i].live_count, (unsigned long long)sites[i].live_bytes,
+                       (unsigned long long)sites[i].alloc_count, (unsigned long long)sites[i].alloc_bytes);
+        for (d = 0; d < sites[i].depth; d++)
+            len += snprintf(line + len, sizeof(line) - len, " %p", sites[i].pc[d]);
+        line[len++] = '\n';
+        if (write_all(fd, line, len) < 0)
+            goto fail;
+    }
+    prof_unlock();
+    busy = 0;
+
+    if (write_all(fd, "\nMAPPED_LIBRARIES:\n", 19) < 0 || (maps = open("/proc/self/maps", O_RDONLY)) < 0)
+        goto fail_unlocked;
+    while ((n = read(maps, line, sizeof(line))) > 0)
+        if (write_all(fd, line, n) < 0)
+            break;
+    close(maps);
+    return close(fd);
+
+fail:
+    prof_unlock();
+    busy = 0;
+fail_unlocked:
+    close(fd);
+    return -1;
+}
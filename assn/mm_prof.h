@@ -0,0 +1,54 @@
+/*
+ * mm_prof.h - sampling heap profiler for the allocator.
+ *
+ * Built with -DMM_PROFILE, mm.c samples about one allocation per
+ * MM_PROF_RATE bytes allocated (the MM_PROF_RATE environment variable
+ * overrides it): each thread counts down the bytes to its next sample, so
+ * an allocation that is not sampled costs one subtraction and one branch.
+ * The distance to the next sample is drawn from an exponential
+ * distribution, which lets pprof scale the samples back up to unbiased
+ * estimates. A sampled block gets the call stack it was allocated from
+ * and the SAMPLED bit in its tags, and stays in the profile's live set
+ * until mm_free() sees the bit. Without MM_PROFILE the macros compile to
+ * nothing.
+ *
+ * mm_prof_dump() writes the live and cumulative allocations by call stack
+ * as a heap profile pprof reads (the legacy "heap_v2" text format), and it
+ * runs at exit on its own when MM_PROF_FILE names a file:
+ *
+ *     unix> make libmm-prof.so
+ *     unix> MM_PROF_FILE=/tmp/heap.prof LD_PRELOAD=./libmm-prof.so <program>
+ *     unix> pprof -inuse_space <program> /tmp/heap.prof
+ *     unix> pprof -alloc_space <program> /tmp/heap.prof
+ */
+#ifndef MM_PROF_H
+#define MM_PROF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MM_PROF_RATE    (512 * 1024)    /* mean bytes between samples */
+#define MM_PROF_DEPTH   32              /* frames kept per stack */
+
+#ifdef MM_PROFILE
+
+extern __thread intptr_t mm_prof_countdown __attribute__((tls_model("initial-exec")));
+int mm_prof_sample(void *bp, size_t size);
+void mm_prof_free(void *bp);
+int mm_prof_dump(const char *path);
+
+#define PROF_ENABLED    1
+#define PROF_DUE(size)  ((mm_prof_countdown -= (intptr_t)(size)) < 0)
+#define PROF_SAMPLE(bp, size)   mm_prof_sample(bp, size)
+#define PROF_FREE(bp)   mm_prof_free(bp)
+
+#else
+
+#define PROF_ENABLED    0
+#define PROF_DUE(size)  0
+#define PROF_SAMPLE(bp, size)   0
+#define PROF_FREE(bp)   ((void)0)
+
+#endif /* MM_PROFILE */
+
+#endif /* MM_PROF_H */
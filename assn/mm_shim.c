@@ -0,0 +1,322 @@
+/*
+ * mm_shim.c - exports the standard C allocation functions on top of the
+ * mm_* allocator, so that unmodified programs can be run on it:
+ *
+ *     unix> make libmm.so
+ *     unix> LD_PRELOAD=./libmm.so /usr/bin/time -v <program>
+ *
+ * The heap comes from memlib_os.c (real OS memory) rather than the 20 MB
+ * mdriver sandbox. mm.c keeps all of its state in globals and is not
+ * thread safe, so every entry point below serializes on a single lock.
+ * The heap is set up lazily by the first allocation.
+ *
+ * MM_SCAVENGE_MS=<ms> starts a scavenger thread: frees no longer give
+ * pages back to the OS themselves, and every <ms> milliseconds the
+ * scavenger runs mm_scavenge() for up to MM_SCAVENGE_BUDGET_US
+ * microseconds (default 1000), in slices of SCAVENGE_SLICE_US between
+ * which the lock is dropped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+/* The library is built with -fvisibility=hidden; only these are exported. */
+#define EXPORT __attribute__((visibility("default")))
+
+/* Requests above this cannot be represented once header overhead is added. */
+#define MAX_REQUEST ((size_t)PTRDIFF_MAX)
+
+static pthread_mutex_t mm_lock = PTHREAD_MUTEX_INITIALIZER;
+static int mm_ready = 0;
+
+#define SCAVENGE_SLICE_US   50      /* longest the scavenger holds mm_lock */
+#define SCAVENGE_BUDGET_US  1000    /* default scavenger time per period */
+static long period_ms, budget_us;   /* MM_SCAVENGE_MS, MM_SCAVENGE_BUDGET_US */
+
+/* Hold the lock across fork() so the child never inherits it mid-operation. */
+static void fork_prepare(void) { pthread_mutex_lock(&mm_lock); }
+static void fork_release(void) { pthread_mutex_unlock(&mm_lock); }
+
+/* The child has no scavenger thread, so its frees release pages again. */
+static void fork_child(void)
+{
+    mm_scavenge_defer(0);
+    pthread_mutex_unlock(&mm_lock);
+}
+
+/*
+ * scavenger - every period_ms, run mm_scavenge() for up to budget_us in
+ *    short slices, so that an allocation waits at most one slice
+ */
+static void *scavenger(void *arg)
+{
+    struct timespec period = { period_ms / 1000, period_ms % 1000 * 1000000L };
+    long spent;
+    int done;
+
+    for (;;) {
+        nanosleep(&period, NULL);
+        for (spent = 0, done = 0; !done && spent < budget_us; spent += SCAVENGE_SLICE_US) {
+            pthread_mutex_lock(&mm_lock);
+            done = !mm_ready || mm_scavenge(SCAVENGE_SLICE_US, NULL);
+            pthread_mutex_unlock(&mm_lock);
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * start_scavenger - start the scavenger thread if MM_SCAVENGE_MS is set,
+ *    with every signal blocked so the program's signals go elsewhere
+ */
+static void start_scavenger(void)
+{
+    char *env = getenv("MM_SCAVENGE_MS");
+    sigset_t all, old;
+    pthread_t tid;
+
+    if (env == NULL || (period_ms = atol(env)) <= 0)
+        return;
+    env = getenv("MM_SCAVENGE_BUDGET_US");
+    budget_us = (env != NULL && atol(env) > 0) ? atol(env) : SCAVENGE_BUDGET_US;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&tid, NULL, scavenger, NULL) == 0) {
+        pthread_detach(tid);
+        mm_scavenge_defer(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * shim_register - runs at load time. pthread_atfork() and pthread_create()
+ * may allocate, so they cannot be called from shim_init() with mm_lock held.
+ */
+__attribute__((constructor)) static void shim_register(void)
+{
+    pthread_atfork(fork_prepare, fork_release, fork_child);
+    start_scavenger();
+}
+
+/*
+ * shim_init - set up memlib and the allocator on first use.
+ * Must be called with mm_lock held.
+ */
+static int shim_init(void)
+{
+    if (mm_ready)
+        return 0;
+    mem_init();
+    if (mm_init() < 0)
+        return -1;
+    mm_ready = 1;
+    return 0;
+}
+
+/*
+ * in_heap - true if ptr was handed out by this allocator: it lies in one
+ *    of the heap's segments, not just between the lowest and highest.
+ *    Call with mm_lock held.
+ */
+static int in_heap(void *ptr)
+{
+    int i;
+
+    if (!mm_ready)
+        return 0;
+    for (i = 0; i < mem_segments(); i++)
+        if ((char *)ptr >= (char *)mem_segment_lo(i) && (char *)ptr <= (char *)mem_segment_hi(i))
+            return 1;
+    return 0;
+}
+
+EXPORT void *malloc(size_t size)
+{
+    void *bp = NULL;
+
+    // mm_malloc() ignores zero-byte requests, but callers expect a unique pointer.
+    if (size == 0)
+        size = 1;
+    if (size > MAX_REQUEST) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_lock(&mm_lock);
+    if (shim_init() == 0)
+        bp = mm_malloc(size);
+    pthread_mutex_unlock(&mm_lock);
+    if (bp == NULL)
+        errno = ENOMEM;
+    return bp;
+}
+
+/*
+ * malloc_hint - malloc() with a lifetime hint (MM_HINT_*), not part of libc.
+ */
+EXPORT void *malloc_hint(size_t size, int hint)
+{
+    void *bp = NULL;
+
+    if (size == 0)
+        size = 1;
+    if (size > MAX_REQUEST) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_lock(&mm_lock);
+    if (shim_init() == 0)
+        bp = mm_malloc_hint(size, hint);
+    pthread_mutex_unlock(&mm_lock);
+    if (bp == NULL)
+        errno = ENOMEM;
+    return bp;
+}
+
+/*
+ * malloc_flags - malloc() with MM_* flags (see mm.h), not part of libc.
+ */
+EXPORT void *malloc_flags(size_t size, int flags)
+{
+    void *bp = NULL;
+
+    if (size == 0)
+        size = 1;
+    if (size > MAX_REQUEST) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_lock(&mm_lock);
+    if (shim_init() == 0)
+        bp = mm_malloc_flags(size, flags);
+    pthread_mutex_unlock(&mm_lock);
+    if (bp == NULL)
+        errno = ENOMEM;
+    return bp;
+}
+
+EXPORT void free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+    pthread_mutex_lock(&mm_lock);
+    if (in_heap(ptr))
+        mm_free(ptr);
+    pthread_mutex_unlock(&mm_lock);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    void *bp = NULL;
+
+    if (nmemb == 0 || size == 0)
+        nmemb = size = 1;
+    if (nmemb > MAX_REQUEST / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_lock(&mm_lock);
+    if (shim_init() == 0)
+        bp = mm_calloc(nmemb, size);
+    pthread_mutex_unlock(&mm_lock);
+    if (bp == NULL)
+        errno = ENOMEM;
+    return bp;
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    void *bp = NULL;
+
+    if (ptr == NULL)
+        return malloc(size);
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (size > MAX_REQUEST) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_lock(&mm_lock);
+    if (in_heap(ptr))
+        bp = mm_realloc(ptr, size);
+    pthread_mutex_unlock(&mm_lock);
+    if (bp == NULL)
+        errno = ENOMEM;
+    return bp;
+}
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+    void *bp = NULL;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (size == 0)
+        size = 1;
+    if (size > MAX_REQUEST - alignment) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_lock(&mm_lock);
+    if (shim_init() == 0)
+        bp = mm_memalign(alignment, size);
+    pthread_mutex_unlock(&mm_lock);
+    if (bp == NULL)
+        errno = ENOMEM;
+    return bp;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *bp;
+
+    if (alignment % sizeof(void *) != 0)
+        return EINVAL;
+    if ((bp = memalign(alignment, size)) == NULL)
+        return errno;
+    *memptr = bp;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return memalign(getpagesize(), size);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+    size_t page = getpagesize();
+
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+    size_t size = 0;
+
+    pthread_mutex_lock(&mm_lock);
+    if (ptr != NULL && in_heap(ptr))
+        size = mm_usable_size(ptr);
+    pthread_mutex_unlock(&mm_lock);
+    return size;
+}
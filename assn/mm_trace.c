@@ -0,0 +1,115 @@
+/*
+ * mm_trace.c - the ring buffers behind TRACE_EVENT() (see mm_trace.h).
+ *
+ * A thread gets its ring on its first event. Rings are mmap'ed, since
+ * malloc may be the allocator being traced, and pushed on a global list
+ * with a compare-and-swap so mm_trace_dump() can find them. They are never
+ * freed: the events of a thread that exited are still dumped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "mm_trace.h"
+
+__thread mm_trace_ring_t *mm_trace_ring __attribute__((tls_model("initial-exec")));
+
+static mm_trace_ring_t *rings = NULL;
+static uint16_t num_rings = 0;
+
+/*
+ * dump_at_exit - write the rings to MM_TRACE_FILE
+ */
+static void dump_at_exit(void)
+{
+    char *path = getenv("MM_TRACE_FILE");
+
+    if (path != NULL && mm_trace_dump(path) < 0)
+        fprintf(stderr, "mm_trace: could not write %s\n", path);
+}
+
+/*
+ * mm_trace_ring_new - give the calling thread a ring and register it.
+ *    Returns NULL if there is no memory for one.
+ */
+mm_trace_ring_t *mm_trace_ring_new(void)
+{
+    mm_trace_ring_t *r;
+
+    r = mmap(NULL, sizeof(mm_trace_ring_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r == MAP_FAILED)
+        return NULL;
+    r->id = __atomic_fetch_add(&num_rings, 1, __ATOMIC_RELAXED);
+    if (r->id == 0 && getenv("MM_TRACE_FILE") != NULL)
+        atexit(dump_at_exit);
+
+    r->next = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        ;
+    mm_trace_ring = r;
+    return r;
+}
+
+/*
+ * write_all - write(2) all of buf, -1 on error
+ */
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, p, len)) <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * mm_trace_dump - write every ring to path. Rings still being written to
+ *    may have their newest events cut off or torn. Returns -1 on error.
+ */
+int mm_trace_dump(const char *path)
+{
+    mm_trace_header_t hdr;
+    mm_trace_ring_t *all, *r;
+    uint64_t head, first;
+    int fd;
+
+    // New rings go on the front of the list, so the one loaded here stays put.
+    all = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MM_TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.event_size = sizeof(mm_trace_event_t);
+    for (r = all; r != NULL; r = r->next)
+        hdr.rings++;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -1;
+    if (write_all(fd, &hdr, sizeof(hdr)) < 0)
+        goto fail;
+
+    // Oldest event first: once a ring has wrapped, that is the one at head.
+    for (r = all; r != NULL; r = r->next) {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (head <= MM_TRACE_RING) {
+            if (write_all(fd, r->ev, head * sizeof(mm_trace_event_t)) < 0)
+                goto fail;
+            continue;
+        }
+        first = head & (MM_TRACE_RING - 1);
+        if (write_all(fd, &r->ev[first], (MM_TRACE_RING - first) * sizeof(mm_trace_event_t)) < 0
+                || write_all(fd, r->ev, first * sizeof(mm_trace_event_t)) < 0)
+            goto fail;
+    }
+    return close(fd);
+
+fail:
+    close(fd);
+    return -1;
+}
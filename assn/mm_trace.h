@@ -0,0 +1,130 @@
+/*
+ * mm_trace.h - binary event tracing for the allocator.
+ *
+ * Built with -DMM_TRACE, every TRACE_EVENT() in mm.c appends one fixed-size
+ * mm_trace_event_t to a ring buffer owned by the calling thread: no locks,
+ * no formatting, no system calls on the hot path. Each ring keeps the last
+ * MM_TRACE_RING events of its thread. Without MM_TRACE, TRACE_EVENT()
+ * compiles to nothing. Calls made inside TRACE_MUTE() / TRACE_UNMUTE()
+ * (the malloc and free of a realloc that moves its block) are not traced,
+ * so every event is one call into the allocator.
+ *
+ * mm_trace_dump() writes the rings of all threads to a file, and it runs
+ * at exit on its own when MM_TRACE_FILE names one. mm_tracedump decodes
+ * the file offline:
+ *
+ *     unix> make libmm-trace.so mm_tracedump
+ *     unix> MM_TRACE_FILE=/tmp/t.bin LD_PRELOAD=./libmm-trace.so <program>
+ *     unix> ./mm_tracedump /tmp/t.bin
+ *
+ * File format: an mm_trace_header_t, then the events of each ring in the
+ * order they happened (rings one after the other; cycles orders them).
+ */
+#ifndef MM_TRACE_H
+#define MM_TRACE_H
+
+#include <stdint.h>
+
+#define MM_TRACE_MAGIC  "MMTRACE1"
+#define MM_TRACE_RING   (1 << 16)       /* events kept per thread */
+
+/* Event types */
+enum {
+    MM_EV_MALLOC = 1,   /* ptr: payload; size: request; aux: hint */
+    MM_EV_FREE,         /* ptr: payload; size: block size */
+    MM_EV_REALLOC,      /* ptr: new payload; size: request; aux: old payload */
+    MM_EV_CALLOC,       /* ptr: payload; size: total request */
+    MM_EV_MEMALIGN,     /* ptr: payload; size: request; aux: alignment */
+    MM_EV_EXTEND,       /* ptr: new free block; size: bytes the heap grew */
+    MM_EV_MOVE,         /* ptr: new payload; size: block size; aux: old payload */
+    MM_EV_RELEASE,      /* ptr: free block; size: bytes given back to the OS */
+    MM_EV_COUNT
+};
+
+/* One event, 32 bytes */
+typedef struct {
+    uint64_t cycles;    /* time stamp counter when it happened */
+    uint64_t ptr;
+    uint64_t aux;
+    uint32_t size;      /* saturates at UINT32_MAX */
+    uint8_t bin;        /* free list the block size maps to */
+    uint8_t op;         /* MM_EV_* */
+    uint16_t ring;      /* which thread's ring, in order of first event */
+} mm_trace_event_t;
+
+typedef struct {
+    char magic[8];      /* MM_TRACE_MAGIC */
+    uint32_t event_size;
+    uint32_t rings;     /* the events of this many rings follow, up to end of file */
+} mm_trace_header_t;
+
+#ifdef MM_TRACE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_CYCLES()  __rdtsc()
+#else
+#include <time.h>
+static inline uint64_t trace_cycles(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#define TRACE_CYCLES()  trace_cycles()
+#endif
+
+typedef struct mm_trace_ring {
+    uint64_t head;                  /* events written so far */
+    uint32_t mute;                  /* nesting of TRACE_MUTE() */
+    uint16_t id;
+    struct mm_trace_ring *next;     /* all rings, newest first */
+    mm_trace_event_t ev[MM_TRACE_RING];
+} mm_trace_ring_t;
+
+extern __thread mm_trace_ring_t *mm_trace_ring __attribute__((tls_model("initial-exec")));
+mm_trace_ring_t *mm_trace_ring_new(void);
+int mm_trace_dump(const char *path);
+
+/* Append an event to this thread's ring */
+static inline void mm_trace_event(int op, const void *ptr, size_t size, int bin, uint64_t aux)
+{
+    mm_trace_ring_t *r = mm_trace_ring;
+    mm_trace_event_t *e;
+
+    if (r == NULL && (r = mm_trace_ring_new()) == NULL)
+        return;
+    if (r->mute)
+        return;
+    e = &r->ev[r->head & (MM_TRACE_RING - 1)];
+    e->cycles = TRACE_CYCLES();
+    e->ptr = (uintptr_t)ptr;
+    e->aux = aux;
+    e->size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+    e->bin = (uint8_t)bin;
+    e->op = (uint8_t)op;
+    e->ring = r->id;
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Leave out the events of the calls an operation makes on its own behalf */
+static inline void mm_trace_mute(int delta)
+{
+    if (mm_trace_ring != NULL || mm_trace_ring_new() != NULL)
+        mm_trace_ring->mute += delta;
+}
+
+#define TRACE_EVENT(op, ptr, size, bin, aux) \
+    mm_trace_event(op, ptr, size, bin, (uint64_t)(aux))
+#define TRACE_MUTE()    mm_trace_mute(1)
+#define TRACE_UNMUTE()  mm_trace_mute(-1)
+
+#else
+
+#define TRACE_EVENT(op, ptr, size, bin, aux)  ((void)0)
+#define TRACE_MUTE()    ((void)0)
+#define TRACE_UNMUTE()  ((void)0)
+
+#endif /* MM_TRACE */
+
+#endif /* MM_TRACE_H */
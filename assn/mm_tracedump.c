@@ -0,0 +1,128 @@
+/*
+ * mm_tracedump.c - decode a trace written by mm_trace_dump().
+ *
+ * Prints the events of all threads merged in time order, one per line:
+ *
+ *     cycles ring op ptr size bin aux
+ *
+ * where cycles counts from the first event. With -s it prints how many
+ * events of each type and how many allocations per free list bin there
+ * were instead. With -r it writes the allocations, reallocations and frees
+ * as a .rep trace file that mdriver and mmbench can replay: each payload
+ * pointer becomes a block id, and frees of blocks allocated before the
+ * trace started are dropped.
+ *
+ * usage: mm_tracedump [-s | -r] <tracefile>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mm_tracefile.h"
+
+static const char *op_names[MM_EV_COUNT] = {
+    "?", "malloc", "free", "realloc", "calloc", "memalign", "extend", "move", "release"
+};
+
+/*
+ * write_rep - print the events as a .rep trace
+ */
+static void write_rep(mm_trace_event_t *ev, size_t n)
+{
+    mm_trace_op_t *ops;
+    size_t num_ops, i;
+    int ids;
+
+    ops = mm_trace_ops(ev, n, &num_ops, &ids);
+    // Header: suggested heap size (unused), ids, ops, weight.
+    printf("0\n%d\n%zu\n1\n", ids, num_ops);
+    for (i = 0; i < num_ops; i++) {
+        if (ops[i].type == 'f')
+            printf("f %d\n", ops[i].id);
+        else
+            printf("%c %d %zu\n", ops[i].type, ops[i].id, ops[i].size);
+    }
+    free(ops);
+}
+
+/*
+ * summary - print the number of events per type and allocations per bin
+ */
+static void summary(mm_trace_event_t *ev, size_t n)
+{
+    unsigned long ops[MM_EV_COUNT] = {0}, bins[256] = {0};
+    int rings = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (ev[i].op < MM_EV_COUNT)
+            ops[ev[i].op]++;
+        if (ev[i].op == MM_EV_MALLOC || ev[i].op == MM_EV_CALLOC || ev[i].op == MM_EV_MEMALIGN || ev[i].op == MM_EV_REALLOC)
+            bins[ev[i].bin]++;
+        if (ev[i].ring >= rings)
+            rings = ev[i].ring + 1;
+    }
+    printf("%zu events from %d threads over %llu cycles\n", n, rings,
+           n ? (unsigned long long)(ev[n - 1].cycles - ev[0].cycles) : 0ULL);
+    for (i = 1; i < MM_EV_COUNT; i++)
+        printf("%-10s %12lu\n", op_names[i], ops[i]);
+    printf("\nallocations per bin (block size <= 2^bin):\n");
+    for (i = 0; i < 256; i++)
+        if (bins[i])
+            printf("%4zu %12lu\n", i, bins[i]);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mm_tracedump [-s | -r] <tracefile>\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h  Print this message.\n");
+    fprintf(stderr, "\t-r  Write the trace as a .rep file.\n");
+    fprintf(stderr, "\t-s  Print a summary instead of the events.\n");
+}
+
+int main(int argc, char **argv)
+{
+    mm_trace_event_t *ev;
+    size_t n, i;
+    int rep = 0, sum = 0, c;
+
+    while ((c = getopt(argc, argv, "hrs")) != EOF) {
+        switch (c) {
+        case 'r':
+            rep = 1;
+            break;
+        case 's':
+            sum = 1;
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        exit(1);
+    }
+
+    ev = mm_trace_read(argv[optind], &n);
+    if (rep) {
+        write_rep(ev, n);
+    } else if (sum) {
+        summary(ev, n);
+    } else {
+        printf("%14s %4s %-8s %18s %10s %3s %18s\n", "cycles", "ring", "op", "ptr", "size", "bin", "aux");
+        for (i = 0; i < n; i++)
+            printf("%14llu %4u %-8s %#18llx %10u %3u %#18llx\n",
+                   (unsigned long long)(ev[i].cycles - ev[0].cycles), ev[i].ring,
+                   ev[i].op < MM_EV_COUNT ? op_names[ev[i].op] : "?",
+                   (unsigned long long)ev[i].ptr, ev[i].size, ev[i].bin, (unsigned long long)ev[i].aux);
+    }
+    free(ev);
+    return 0;
+}
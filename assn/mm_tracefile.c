@@ -0,0 +1,247 @@
+/*
+ * mm_tracefile.c - read binary and .rep traces (see mm_tracefile.h).
+ *
+ * Everything here exits with a message on a bad or unreadable file; the
+ * callers are command line tools.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mm_tracefile.h"
+
+#define MAXLINE 1024
+
+/*
+ * grow - make room for one more element in *buf of *cap
+ */
+static void *grow(void *buf, size_t n, size_t *cap, size_t elem, const char *path)
+{
+    if (n < *cap)
+        return buf;
+    *cap = *cap ? 2 * *cap : 4096;
+    if ((buf = realloc(buf, *cap * elem)) == NULL) {
+        fprintf(stderr, "Out of memory reading %s\n", path);
+        exit(1);
+    }
+    return buf;
+}
+
+/*
+ * mm_trace_read - read every event of a binary trace, sorted by cycles
+ */
+mm_trace_event_t *mm_trace_read(const char *path, size_t *count)
+{
+    mm_trace_header_t hdr;
+    mm_trace_event_t *ev = NULL;
+    size_t n = 0, cap = 0;
+    FILE *fp;
+
+    if ((fp = fopen(path, "rb")) == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        exit(1);
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, MM_TRACE_MAGIC, sizeof(hdr.magic)) != 0
+            || hdr.event_size != sizeof(mm_trace_event_t)) {
+        fprintf(stderr, "%s is not an allocator trace\n", path);
+        exit(1);
+    }
+    for (;;) {
+        ev = grow(ev, n, &cap, sizeof(*ev), path);
+        if (fread(&ev[n], sizeof(*ev), 1, fp) != 1)
+            break;
+        n++;
+    }
+    fclose(fp);
+
+    // Each ring is in order already; a stable merge keeps ties in ring order.
+    {
+        mm_trace_event_t *tmp = malloc(n * sizeof(*ev) + 1);
+        size_t width, i, a, b, end, mid, k;
+
+        for (width = 1; width < n; width *= 2) {
+            for (i = 0; i < n; i += 2 * width) {
+                mid = i + width < n ? i + width : n;
+                end = i + 2 * width < n ? i + 2 * width : n;
+                for (a = i, b = mid, k = i; k < end; k++)
+                    tmp[k] = (b >= end || (a < mid && ev[a].cycles <= ev[b].cycles)) ? ev[a++] : ev[b++];
+            }
+            memcpy(ev, tmp, n * sizeof(*ev));
+        }
+        free(tmp);
+    }
+    *count = n;
+    return ev;
+}
+
+/* Payload pointer to block id, open addressing */
+typedef struct {
+    uint64_t *ptr;
+    int *id;
+    size_t mask;
+} idmap_t;
+
+static size_t slot(idmap_t *m, uint64_t ptr)
+{
+    size_t i = (ptr >> 4) * 0x9e3779b97f4a7c15ULL & m->mask;
+
+    while (m->ptr[i] != 0 && m->ptr[i] != ptr)
+        i = (i + 1) & m->mask;
+    return i;
+}
+
+/* Remove slot i, moving back the entries that probed past it */
+static void unslot(idmap_t *m, size_t i)
+{
+    size_t j = i, k;
+
+    m->ptr[i] = 0;
+    for (;;) {
+        j = (j + 1) & m->mask;
+        if (m->ptr[j] == 0)
+            return;
+        k = (m->ptr[j] >> 4) * 0x9e3779b97f4a7c15ULL & m->mask;
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            m->ptr[i] = m->ptr[j];
+            m->id[i] = m->id[j];
+            m->ptr[j] = 0;
+            i = j;
+        }
+    }
+}
+
+/*
+ * mm_trace_ops - the allocations, reallocations and frees among n events
+ *    as requests on block ids: each payload pointer becomes an id while it
+ *    is live, and frees of blocks allocated before the trace started are
+ *    dropped.
+ */
+mm_trace_op_t *mm_trace_ops(const mm_trace_event_t *ev, size_t n, size_t *num_ops, int *num_ids)
+{
+    mm_trace_op_t *ops = malloc(n * sizeof(mm_trace_op_t) + 1);
+    idmap_t m;
+    size_t i, s, nops = 0, cap;
+    int ids = 0;
+
+    for (cap = 16; cap < 2 * n; cap *= 2)
+        ;
+    m.ptr = calloc(cap, sizeof(uint64_t));
+    m.id = calloc(cap, sizeof(int));
+    m.mask = cap - 1;
+
+    for (i = 0; i < n; i++) {
+        const mm_trace_event_t *e = &ev[i];
+
+        switch (e->op) {
+        case MM_EV_MALLOC:
+        case MM_EV_CALLOC:
+        case MM_EV_MEMALIGN:
+            s = slot(&m, e->ptr);
+            m.ptr[s] = e->ptr;
+            m.id[s] = ids++;
+            ops[nops++] = (mm_trace_op_t){ 'a', m.id[s], e->size };
+            break;
+        case MM_EV_REALLOC:
+            s = slot(&m, e->aux);
+            if (m.ptr[s] == 0) {
+                // Allocated before the trace began: a new block as far as we know.
+                s = slot(&m, e->ptr);
+                m.ptr[s] = e->ptr;
+                m.id[s] = ids++;
+                ops[nops++] = (mm_trace_op_t){ 'a', m.id[s], e->size };
+            } else {
+                int id = m.id[s];
+                ops[nops++] = (mm_trace_op_t){ 'r', id, e->size };
+                unslot(&m, s);
+                s = slot(&m, e->ptr);
+                m.ptr[s] = e->ptr;
+                m.id[s] = id;
+            }
+            break;
+        case MM_EV_FREE:
+            s = slot(&m, e->ptr);
+            if (m.ptr[s] == 0)
+                break;
+            ops[nops++] = (mm_trace_op_t){ 'f', m.id[s], 0 };
+            unslot(&m, s);
+            break;
+        }
+    }
+    free(m.ptr);
+    free(m.id);
+    *num_ops = nops;
+    *num_ids = ids;
+    return ops;
+}
+
+/*
+ * read_rep - read the requests of a .rep trace
+ */
+static mm_trace_op_t *read_rep(const char *path, size_t *num_ops, int *num_ids)
+{
+    FILE *fp;
+    mm_trace_op_t *ops = NULL;
+    size_t n = 0, cap = 0;
+    int sugg_heapsize, ids, count, weight;
+    char type[MAXLINE];
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        exit(1);
+    }
+    if (fscanf(fp, "%d %d %d %d", &sugg_heapsize, &ids, &count, &weight) != 4) {
+        fprintf(stderr, "Bad header in tracefile %s\n", path);
+        exit(1);
+    }
+    while (fscanf(fp, "%s", type) == 1) {
+        mm_trace_op_t *op;
+
+        ops = grow(ops, n, &cap, sizeof(*ops), path);
+        op = &ops[n];
+        op->type = type[0];
+        op->size = 0;
+        if ((op->type == 'a' || op->type == 'r') ? fscanf(fp, "%d %zu", &op->id, &op->size) != 2
+                : op->type == 'f' ? fscanf(fp, "%d", &op->id) != 1 : 1) {
+            fprintf(stderr, "Bad request %zu in tracefile %s\n", n, path);
+            exit(1);
+        }
+        if (op->id < 0 || op->id >= ids) {
+            fprintf(stderr, "Block id %d out of range in tracefile %s\n", op->id, path);
+            exit(1);
+        }
+        n++;
+    }
+    fclose(fp);
+    *num_ops = n;
+    *num_ids = ids;
+    return ops;
+}
+
+/*
+ * mm_trace_load - the requests of a trace in either format, told apart
+ *    by the binary trace's magic number
+ */
+mm_trace_op_t *mm_trace_load(const char *path, size_t *num_ops, int *num_ids)
+{
+    char magic[sizeof(((mm_trace_header_t *)0)->magic)];
+    mm_trace_event_t *ev;
+    mm_trace_op_t *ops;
+    size_t n;
+    FILE *fp;
+    int binary;
+
+    if ((fp = fopen(path, "rb")) == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        exit(1);
+    }
+    binary = fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, MM_TRACE_MAGIC, sizeof(magic)) == 0;
+    fclose(fp);
+    if (!binary)
+        return read_rep(path, num_ops, num_ids);
+
+    ev = mm_trace_read(path, &n);
+    ops = mm_trace_ops(ev, n, num_ops, num_ids);
+    free(ev);
+    return ops;
+}
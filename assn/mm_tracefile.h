@@ -0,0 +1,27 @@
+/*
+ * mm_tracefile.h - reading traces for the offline tools.
+ *
+ * Two formats: the binary event traces written by mm_trace_dump() (see
+ * mm_trace.h), and the .rep text traces mdriver replays. Either can be
+ * turned into a list of requests on block ids, the way a .rep file has
+ * them.
+ */
+#ifndef MM_TRACEFILE_H
+#define MM_TRACEFILE_H
+
+#include <stddef.h>
+
+#include "mm_trace.h"
+
+/* One request of a trace */
+typedef struct {
+    char type;      /* 'a' (alloc), 'r' (realloc) or 'f' (free) */
+    int id;         /* the block it is on */
+    size_t size;    /* requested size for 'a' and 'r' */
+} mm_trace_op_t;
+
+mm_trace_event_t *mm_trace_read(const char *path, size_t *count);
+mm_trace_op_t *mm_trace_ops(const mm_trace_event_t *ev, size_t n, size_t *num_ops, int *num_ids);
+mm_trace_op_t *mm_trace_load(const char *path, size_t *num_ops, int *num_ids);
+
+#endif /* MM_TRACEFILE_H */
@@ -0,0 +1,469 @@
+/*
+ * mmanalyze.c - what a trace asks of an allocator, independent of mm.c.
+ *
+ * Reads .rep traces or binary traces from mm_trace_dump() and reports, for
+ * each one:
+ *
+ *   - how big the heap has to be: the peak of the live payload, and the
+ *     peak of the live blocks with mm.c's boundary tags and alignment. No
+ *     allocator with mm.c's block layout can do with less heap than the
+ *     latter, so payload peak / block peak is the best utilization mdriver
+ *     could report for the trace.
+ *   - request sizes, per power of two bin (the free_list_i mapping of
+ *     mm.c) and the most frequent sizes
+ *   - object lifetimes, in requests and in bytes requested in between
+ *   - the live payload over the course of the trace
+ *   - realloc chains: how many times blocks are reallocated, and by how much
+ *     each step grows them
+ *   - the set of -k size classes (default 16) that wastes the fewest bytes
+ *     to rounding, against power of two classes
+ *
+ * usage: mmanalyze [-k <classes>] [-p <points>] <trace>...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mm_tracefile.h"
+
+/* mm.c's block layout with 64-bit tags */
+#define WSIZE       8
+#define DSIZE       16
+#define TSIZE       WSIZE
+#define MIN_BLOCK   (2 * DSIZE)
+#define HEAP_OVERHEAD   (4 * WSIZE)     /* padding, prologue and epilogue */
+#define BLOCK_SIZE(size)    ((size) + 2*TSIZE <= MIN_BLOCK ? MIN_BLOCK : DSIZE * (((size) + 2*TSIZE + DSIZE - 1) / DSIZE))
+
+#define BUCKETS     64      /* log2 histogram buckets */
+#define TOP_SIZES   8
+#define TOP_CHAINS  5
+#define BAR_WIDTH   50
+#define DEFAULT_CLASSES 16
+#define DEFAULT_POINTS  20
+
+/* What the analysis keeps per block id */
+typedef struct {
+    long born;              /* request that allocated it, -1 when not live */
+    uint64_t born_bytes;    /* bytes requested before it */
+    size_t size;            /* current request size */
+    size_t first_size;      /* size it was allocated with */
+    int reallocs;           /* reallocs since */
+} object_t;
+
+/* A realloc chain that ended, for the longest ones */
+typedef struct {
+    int id;
+    int length;
+    size_t first_size, last_size;
+} chain_t;
+
+/*
+ * log2_bucket - the bucket of a log2 histogram that holds x: 0 for 0 and
+ *    1, else the number of bits of x - 1
+ */
+static int log2_bucket(uint64_t x)
+{
+    return x <= 1 ? 0 : 64 - __builtin_clzll(x - 1);
+}
+
+/*
+ * print_histogram - the non-empty buckets of a log2 histogram, and of a
+ *    second one (if b is not NULL) side by side, bucket i being
+ *    (2^(i-1), 2^i]. Each column's percentages are of its total.
+ */
+static void print_histogram(const char *what, const char *a_name, uint64_t *a, uint64_t a_total,
+                            const char *b_name, uint64_t *b, uint64_t b_total)
+{
+    int i;
+
+    printf("%12s %12s %7s", what, a_name, "%");
+    printf(b != NULL ? " %12s %7s\n" : "\n", b_name, "%");
+    for (i = 0; i < BUCKETS; i++) {
+        if (a[i] == 0 && (b == NULL || b[i] == 0))
+            continue;
+        printf("%12llu %12llu %6.1f%%", i == 0 ? 1ULL : 1ULL << i,
+               (unsigned long long)a[i], 100.0 * a[i] / (a_total ? a_total : 1));
+        if (b != NULL)
+            printf(" %12llu %6.1f%%", (unsigned long long)b[i], 100.0 * b[i] / (b_total ? b_total : 1));
+        printf("\n");
+    }
+}
+
+/*
+ * end_chain - the allocation of block id is over: count its realloc chain,
+ *    if it had one, and keep it if it is among the longest
+ */
+static void end_chain(object_t *o, int id, chain_t *top, uint64_t *hist, unsigned long *chains)
+{
+    int j;
+
+    if (o->born < 0 || o->reallocs == 0)
+        return;
+    (*chains)++;
+    hist[log2_bucket(o->reallocs)]++;
+    for (j = 0; j < TOP_CHAINS && top[j].length >= o->reallocs; j++)
+        ;
+    if (j < TOP_CHAINS) {
+        memmove(&top[j + 1], &top[j], (TOP_CHAINS - j - 1) * sizeof(chain_t));
+        top[j] = (chain_t){ id, o->reallocs, o->first_size, o->size };
+    }
+    o->reallocs = 0;
+}
+
+static int cmp_size(const void *a, const void *b)
+{
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* State of the size class search */
+typedef struct {
+    size_t *v;              /* distinct block sizes, ascending */
+    uint64_t *w, *s;        /* prefix sums of their counts and bytes */
+    uint64_t *prev, *cur;   /* least waste with k - 1 and k classes */
+    int *choice;            /* where the last class starts, per k and size */
+    int d;
+} classes_t;
+
+/*
+ * waste - bytes lost rounding the sizes v[i..j] up to v[j]
+ */
+static uint64_t waste(classes_t *c, int i, int j)
+{
+    return (uint64_t)c->v[j] * (c->w[j + 1] - c->w[i]) - (c->s[j + 1] - c->s[i]);
+}
+
+/*
+ * solve - cur[j] for lo <= j <= hi, knowing that the best start of the last
+ *    class lies in [from, to]. The best start never moves left as j grows,
+ *    so splitting on the middle j costs O(d log d) per k.
+ */
+static void solve(classes_t *c, int k, int lo, int hi, int from, int to)
+{
+    int mid, i, best;
+    uint64_t cost, least = UINT64_MAX;
+
+    if (lo > hi)
+        return;
+    mid = (lo + hi) / 2;
+    best = from;
+    for (i = from; i <= to && i <= mid; i++) {
+        cost = (i == 0 ? 0 : c->prev[i - 1]) + waste(c, i, mid);
+        if (cost < least) {
+            least = cost;
+            best = i;
+        }
+    }
+    c->cur[mid] = least;
+    c->choice[(size_t)k * c->d + mid] = best;
+    solve(c, k, lo, mid - 1, from, best);
+    solve(c, k, mid + 1, hi, best, to);
+}
+
+/*
+ * size_classes - print the k size classes that waste the fewest bytes on
+ *    the n block sizes in sizes (sorted), and what power of two classes
+ *    would waste
+ */
+static void size_classes(size_t *sizes, size_t n, int k)
+{
+    classes_t c;
+    size_t *bound;
+    uint64_t requested = 0, pow2 = 0, *tmp;
+    size_t i;
+    int j, q, classes;
+
+    if (n == 0)
+        return;
+    c.v = malloc(n * sizeof(size_t));
+    c.w = calloc(n + 1, sizeof(uint64_t));
+    c.s = calloc(n + 1, sizeof(uint64_t));
+    for (i = 0, c.d = 0; i < n; i++) {
+        if (c.d == 0 || c.v[c.d - 1] != sizes[i]) {
+            c.v[c.d] = sizes[i];
+            c.w[c.d + 1] = c.w[c.d];
+            c.s[c.d + 1] = c.s[c.d];
+            c.d++;
+        }
+        c.w[c.d]++;
+        c.s[c.d] += sizes[i];
+        requested += sizes[i];
+        pow2 += ((size_t)1 << log2_bucket(sizes[i])) - sizes[i];
+    }
+    classes = k < c.d ? k : c.d;
+
+    c.prev = malloc(c.d * sizeof(uint64_t));
+    c.cur = malloc(c.d * sizeof(uint64_t));
+    c.choice = malloc((size_t)(classes + 1) * c.d * sizeof(int));
+    for (j = 0; j < c.d; j++) {
+        c.prev[j] = waste(&c, 0, j);
+        c.choice[(size_t)1 * c.d + j] = 0;
+    }
+    for (q = 2; q <= classes; q++) {
+        solve(&c, q, 0, c.d - 1, 0, c.d - 1);
+        tmp = c.prev;
+        c.prev = c.cur;
+        c.cur = tmp;
+    }
+
+    // Walk the choices back from the largest size for the class bounds.
+    bound = malloc(classes * sizeof(size_t));
+    for (q = classes, j = c.d - 1; q >= 1 && j >= 0; q--) {
+        bound[q - 1] = c.v[j];
+        j = c.choice[(size_t)q * c.d + j] - 1;
+    }
+    // Fewer classes did as well (never with distinct sizes): drop the rest.
+    memmove(bound, bound + q, (classes - q) * sizeof(size_t));
+    classes -= q;
+    printf("best %d classes (block bytes):", classes);
+    for (q = 0; q < classes; q++)
+        printf("%s%zu", q % 10 == 0 ? "\n   " : " ", bound[q]);
+    printf("\nrounding waste: %llu bytes (%.2f%% of %llu) with them, %llu (%.2f%%) with powers of two\n",
+           (unsigned long long)c.prev[c.d - 1], 100.0 * c.prev[c.d - 1] / requested, (unsigned long long)requested,
+           (unsigned long long)pow2, 100.0 * pow2 / requested);
+
+    free(bound);
+    free(c.v);
+    free(c.w);
+    free(c.s);
+    free(c.prev);
+    free(c.cur);
+    free(c.choice);
+}
+
+/*
+ * analyze - print the report for one trace
+ */
+static void analyze(const char *path, int k, int points)
+{
+    mm_trace_op_t *ops;
+    object_t *obj;
+    chain_t top[TOP_CHAINS];
+    size_t num_ops, i, n_sizes = 0, *sizes, *blocks, peak_at = 0;
+    uint64_t live = 0, live_blocks = 0, peak = 0, peak_blocks = 0, requested = 0;
+    uint64_t size_hist[BUCKETS] = {0}, byte_hist[BUCKETS] = {0};
+    uint64_t life_ops[BUCKETS] = {0}, life_bytes[BUCKETS] = {0}, chain_hist[BUCKETS] = {0};
+    unsigned long count[3] = {0}, freed = 0, never_freed = 0;
+    unsigned long chains = 0, steps = 0, grew = 0, doubled = 0;
+    uint64_t *curve;
+    double ratio_sum = 0;
+    int num_ids, id, j;
+
+    ops = mm_trace_load(path, &num_ops, &num_ids);
+    obj = calloc(num_ids + 1, sizeof(object_t));
+    for (id = 0; id < num_ids; id++)
+        obj[id].born = -1;
+    sizes = malloc((num_ops + 1) * sizeof(size_t));
+    blocks = malloc((num_ops + 1) * sizeof(size_t));
+    curve = calloc(points + 1, sizeof(uint64_t));
+    memset(top, 0, sizeof(top));
+
+    for (i = 0; i < num_ops; i++) {
+        mm_trace_op_t *op = &ops[i];
+        object_t *o = &obj[op->id];
+
+        switch (op->type) {
+        case 'a':
+            count[0]++;
+            if (o->born >= 0) {
+                live -= o->size;
+                live_blocks -= BLOCK_SIZE(o->size);
+            }
+            o->born = i;
+            o->born_bytes = requested;
+            o->size = op->size;
+            break;
+        case 'r':
+            count[1]++;
+            if (o->born < 0) {
+                // A realloc of nothing is a malloc.
+                o->born = i;
+                o->born_bytes = requested;
+            } else {
+                live -= o->size;
+                live_blocks -= BLOCK_SIZE(o->size);
+                steps++;
+                if (op->size > o->size) {
+                    grew++;
+                    if (o->size > 0)
+                        ratio_sum += (double)op->size / o->size;
+                    if (op->size >= 2 * o->size)
+                        doubled++;
+                }
+            }
+            o->size = op->size;
+            break;
+        case 'f':
+            count[2]++;
+            if (o->born < 0)
+                break;
+            live -= o->size;
+            live_blocks -= BLOCK_SIZE(o->size);
+            life_ops[log2_bucket(i - o->born)]++;
+            life_bytes[log2_bucket(requested - o->born_bytes)]++;
+            freed++;
+            o->born = -1;
+            break;
+        }
+
+        if (op->type != 'f') {
+            requested += op->size;
+            live += op->size;
+            live_blocks += BLOCK_SIZE(op->size);
+            size_hist[log2_bucket(op->size)]++;
+            byte_hist[log2_bucket(op->size)] += op->size;
+            sizes[n_sizes] = op->size;
+            blocks[n_sizes++] = BLOCK_SIZE(op->size);
+        }
+        if (live > peak) {
+            peak = live;
+            peak_at = i;
+        }
+        if (live_blocks > peak_blocks)
+            peak_blocks = live_blocks;
+        j = (int)(i * points / num_ops);
+        if (live > curve[j])
+            curve[j] = live;
+    }
+    for (id = 0; id < num_ids; id++)
+        if (obj[id].born >= 0)
+            never_freed++;
+
+    printf("=== %s\n", path);
+    printf("requests: %zu (%lu malloc, %lu realloc, %lu free) on %d blocks\n",
+           num_ops, count[0], count[1], count[2], num_ids);
+    printf("peak live payload: %llu bytes at request %zu\n", (unsigned long long)peak, peak_at);
+    printf("heap lower bound: %llu bytes (peak live blocks with mm.c's tags and alignment)\n",
+           (unsigned long long)(peak_blocks + HEAP_OVERHEAD));
+    printf("best utilization: %.1f%%\n\n", peak ? 100.0 * peak / (peak_blocks + HEAP_OVERHEAD) : 100.0);
+
+    printf("request sizes (malloc and realloc), per power of two bin:\n");
+    print_histogram("size <=", "requests", size_hist, n_sizes, "bytes", byte_hist, requested);
+    qsort(sizes, n_sizes, sizeof(size_t), cmp_size);
+    {
+        size_t best[TOP_SIZES], best_n[TOP_SIZES], run;
+        int t, m;
+
+        memset(best_n, 0, sizeof(best_n));
+        for (i = 0; i < n_sizes; i += run) {
+            for (run = 1; i + run < n_sizes && sizes[i + run] == sizes[i]; run++)
+                ;
+            for (t = 0; t < TOP_SIZES && best_n[t] >= run; t++)
+                ;
+            if (t == TOP_SIZES)
+                continue;
+            for (m = TOP_SIZES - 1; m > t; m--) {
+                best[m] = best[m - 1];
+                best_n[m] = best_n[m - 1];
+            }
+            best[t] = sizes[i];
+            best_n[t] = run;
+        }
+        printf("most frequent:");
+        for (t = 0; t < TOP_SIZES && best_n[t] > 0; t++)
+            printf(" %zu (%zu)", best[t], best_n[t]);
+        printf("\n\n");
+    }
+
+    printf("lifetimes of the %lu freed blocks (%lu never freed):\n", freed, never_freed);
+    print_histogram("length <=", "in requests", life_ops, freed, "in bytes", life_bytes, freed);
+    printf("\n");
+
+    printf("live payload over the trace (peak of each 1/%d):\n", points);
+    for (j = 0; j < points; j++) {
+        int bar = peak ? (int)(curve[j] * BAR_WIDTH / peak) : 0;
+        printf("%3d%% %12llu |%.*s\n", j * 100 / points, (unsigned long long)curve[j], bar,
+               "##################################################");
+    }
+    printf("\n");
+
+    // Realloc chains: one per allocation that was reallocated at least once.
+    memset(obj, 0, (num_ids + 1) * sizeof(object_t));
+    for (id = 0; id < num_ids; id++)
+        obj[id].born = -1;
+    for (i = 0; i < num_ops; i++) {
+        mm_trace_op_t *op = &ops[i];
+        object_t *o = &obj[op->id];
+
+        if (op->type == 'f' || op->type == 'a')
+            end_chain(o, op->id, top, chain_hist, &chains);
+        if (op->type == 'f') {
+            o->born = -1;
+        } else if (op->type == 'a' || o->born < 0) {
+            o->born = i;
+            o->first_size = o->size = op->size;
+            o->reallocs = 0;
+        } else {
+            o->reallocs++;
+            o->size = op->size;
+        }
+    }
+    for (id = 0; id < num_ids; id++)
+        end_chain(&obj[id], id, top, chain_hist, &chains);
+    printf("realloc chains: %lu; %lu reallocs, %lu grew the block", chains, steps, grew);
+    if (grew > 0)
+        printf(" (by %.2fx on average, %lu at least doubled it)", ratio_sum / grew, doubled);
+    printf("\n");
+    if (chains > 0) {
+        print_histogram("reallocs <=", "chains", chain_hist, chains, NULL, NULL, 0);
+        printf("longest:");
+        for (j = 0; j < TOP_CHAINS && top[j].length > 0; j++)
+            printf(" block %d: %d reallocs, %zu -> %zu bytes;", top[j].id, top[j].length,
+                   top[j].first_size, top[j].last_size);
+        printf("\n");
+    }
+    printf("\n");
+
+    qsort(blocks, n_sizes, sizeof(size_t), cmp_size);
+    size_classes(blocks, n_sizes, k);
+    printf("\n");
+
+    free(ops);
+    free(obj);
+    free(sizes);
+    free(blocks);
+    free(curve);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mmanalyze [-h] [-k <classes>] [-p <points>] <trace>...\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h            Print this message.\n");
+    fprintf(stderr, "\t-k <classes>  Number of size classes to fit (default %d).\n", DEFAULT_CLASSES);
+    fprintf(stderr, "\t-p <points>   Points on the live payload curve (default %d).\n", DEFAULT_POINTS);
+    fprintf(stderr, "Traces are .rep files or binary traces from mm_trace_dump().\n");
+}
+
+int main(int argc, char **argv)
+{
+    int k = DEFAULT_CLASSES, points = DEFAULT_POINTS;
+    int c;
+
+    while ((c = getopt(argc, argv, "hk:p:")) != EOF) {
+        switch (c) {
+        case 'k':
+            k = atoi(optarg);
+            break;
+        case 'p':
+            points = atoi(optarg);
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (optind == argc || k < 1 || points < 1) {
+        usage();
+        exit(1);
+    }
+    for (; optind < argc; optind++)
+        analyze(argv[optind], k, points);
+    return 0;
+}
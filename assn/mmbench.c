@@ -0,0 +1,527 @@
+/*
+ * mmbench.c - replay benchmark for the allocator over real OS memory.
+ *
+ * Replays trace files through mm.c linked against memlib_os.c (unlike
+ * mdriver, which uses the malloc'ed memlib.o sandbox), writes every
+ * payload the way a program would, and reports throughput together with
+ * the data TLB misses taken during the replay. With -H each trace is
+ * replayed twice, with and without memlib_os.c's huge page mode. With -c
+ * every block is a relocatable mm_halloc() block instead, and mm_compact()
+ * gets a time budget after each free.
+ *
+ * With -R it runs large realloc chains instead of the traces, with and
+ * without mm_realloc()'s large copy path (see mm_large_copy()): CHAINS
+ * buffers are grown in turn by a quarter at a time, from 64 KB to the given
+ * size, writing only the bytes each step adds. Between steps the benchmark
+ * reads a HOT_SET sized array, as the rest of a program would, so that the
+ * cost of the copies pushing it out of the cache shows up as well.
+ *
+ * With -p it reports a set of hardware counters per op instead: cycles,
+ * instructions, L1d and last level cache read misses, dTLB misses and
+ * branch mispredicts, plus the instructions per cycle, for each trace and
+ * over all the traces.
+ *
+ * Counters are read with perf_event_open(); those that are not available
+ * (no PMU, or perf_event_paranoid too strict) print as n/a. When there are
+ * more counters than the PMU has registers, the kernel multiplexes them and
+ * the counts are scaled up to the whole replay.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define MAXLINE 1024
+#define DEFAULT_TRACEDIR "../traces/"
+#define DEFAULT_REPS 10
+#define CHAINS 4                /* buffers grown in turn by -R */
+#define CHAIN_START (64 << 10)  /* and their starting size */
+#define HOT_SET (256 << 10)     /* data read between -R steps */
+
+/* The traces mdriver replays by default */
+static char *default_tracefiles[] = {
+    "amptjp-bal.rep", "cccp-bal.rep", "cp-decl-bal.rep", "expr-bal.rep",
+    "coalescing-bal.rep", "random-bal.rep", "random2-bal.rep",
+    "binary-bal.rep", "binary2-bal.rep", "realloc-bal.rep",
+    "realloc2-bal.rep", NULL
+};
+
+/* One request of a trace */
+typedef struct {
+    char type;      /* 'a' (alloc), 'r' (realloc) or 'f' (free) */
+    int index;      /* id of the block */
+    size_t size;    /* requested size for 'a' and 'r' */
+} traceop_t;
+
+/* A trace file, same layout as mdriver's .rep files */
+typedef struct {
+    int num_ids;
+    int num_ops;
+    traceop_t *ops;
+    char **blocks;  /* live payload of each id during a replay */
+    mm_handle_t *handles;   /* live handle of each id in a -c replay */
+    size_t *sizes;          /* and its size */
+} trace_t;
+
+/*
+ * read_trace - parse a .rep trace file, exits on error
+ */
+static trace_t *read_trace(char *path)
+{
+    FILE *fp;
+    trace_t *trace;
+    int sugg_heapsize, weight, i;
+    char type[MAXLINE];
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Could not open %s in read_trace\n", path);
+        exit(1);
+    }
+    trace = malloc(sizeof(trace_t));
+    if (fscanf(fp, "%d %d %d %d", &sugg_heapsize, &trace->num_ids, &trace->num_ops, &weight) != 4) {
+        fprintf(stderr, "Bad header in tracefile %s\n", path);
+        exit(1);
+    }
+    trace->ops = calloc(trace->num_ops, sizeof(traceop_t));
+    trace->blocks = calloc(trace->num_ids, sizeof(char *));
+    trace->handles = calloc(trace->num_ids, sizeof(mm_handle_t));
+    trace->sizes = calloc(trace->num_ids, sizeof(size_t));
+
+    for (i = 0; i < trace->num_ops && fscanf(fp, "%s", type) == 1; i++) {
+        traceop_t *op = &trace->ops[i];
+
+        op->type = type[0];
+        switch (op->type) {
+        case 'a':
+        case 'r':
+            if (fscanf(fp, "%d %zu", &op->index, &op->size) != 2)
+                i = trace->num_ops;
+            break;
+        case 'f':
+            if (fscanf(fp, "%d", &op->index) != 1)
+                i = trace->num_ops;
+            break;
+        default:
+            fprintf(stderr, "Bogus type character (%c) in tracefile %s\n", type[0], path);
+            exit(1);
+        }
+    }
+    if (i != trace->num_ops) {
+        fprintf(stderr, "Tracefile %s is truncated\n", path);
+        exit(1);
+    }
+    fclose(fp);
+    return trace;
+}
+
+/*
+ * free_trace - release a trace read by read_trace()
+ */
+static void free_trace(trace_t *trace)
+{
+    free(trace->ops);
+    free(trace->blocks);
+    free(trace->handles);
+    free(trace->sizes);
+    free(trace);
+}
+
+/*
+ * replay - run every request of the trace once on a fresh heap and
+ *    write each new payload. Returns -1 if the allocator fails.
+ */
+static int replay(trace_t *trace)
+{
+    int i;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+        return -1;
+
+    for (i = 0; i < trace->num_ops; i++) {
+        traceop_t *op = &trace->ops[i];
+        char *p;
+
+        switch (op->type) {
+        case 'a':
+            if ((p = mm_malloc(op->size)) == NULL)
+                return -1;
+            memset(p, op->index, op->size);
+            trace->blocks[op->index] = p;
+            break;
+        case 'r':
+            if ((p = mm_realloc(trace->blocks[op->index], op->size)) == NULL)
+                return -1;
+            memset(p, op->index, op->size);
+            trace->blocks[op->index] = p;
+            break;
+        case 'f':
+            mm_free(trace->blocks[op->index]);
+            trace->blocks[op->index] = NULL;
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * replay_handles - replay() through relocatable blocks, compacting for
+ *    budget_us microseconds after every free. A realloc is a new block
+ *    plus a copy. Returns -1 if the allocator fails.
+ */
+static int replay_handles(trace_t *trace, long budget_us)
+{
+    int i;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+        return -1;
+
+    for (i = 0; i < trace->num_ops; i++) {
+        traceop_t *op = &trace->ops[i];
+        mm_handle_t h, old;
+        char *p;
+
+        switch (op->type) {
+        case 'a':
+        case 'r':
+            if ((h = mm_halloc(op->size)) == NULL)
+                return -1;
+            p = mm_hlock(h);
+            memset(p, op->index, op->size);
+            if ((old = trace->handles[op->index]) != NULL) {
+                memcpy(p, mm_hlock(old), op->size < trace->sizes[op->index] ? op->size : trace->sizes[op->index]);
+                mm_hunlock(old);
+                mm_hfree(old);
+            }
+            mm_hunlock(h);
+            trace->handles[op->index] = h;
+            trace->sizes[op->index] = op->size;
+            break;
+        case 'f':
+            mm_hfree(trace->handles[op->index]);
+            trace->handles[op->index] = NULL;
+            mm_compact(budget_us);
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * perf_open - open a counter for this process, -1 if unavailable
+ */
+static int perf_open(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+#define CACHE_MISS(cache, op) ((cache) | ((op) << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+/* What -p reports, one column each */
+enum { CYCLES, INSTRUCTIONS, L1D_MISSES, LLC_MISSES, DTLB_MISSES, BRANCH_MISSES, NUM_COUNTERS };
+static char *counter_names[NUM_COUNTERS] = {
+    "cycles/op", "instr/op", "L1d/op", "LLC/op", "dTLB/op", "brmiss/op"
+};
+
+/* The events behind each column; the counts of a column's events add up */
+static const struct {
+    int counter;
+    uint32_t type;
+    uint64_t config;
+} events[] = {
+    { CYCLES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { INSTRUCTIONS, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { L1D_MISSES, PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ) },
+    { LLC_MISSES, PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ) },
+    { DTLB_MISSES, PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ) },
+    { DTLB_MISSES, PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_WRITE) },
+    { BRANCH_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+#define NUM_EVENTS (int)(sizeof(events) / sizeof(events[0]))
+
+/* Sums over all traces for -p; a counter missing on any trace is n/a */
+static double total_counts[NUM_COUNTERS], total_ops;
+static int total_missing[NUM_COUNTERS];
+
+/*
+ * counters_start - open and enable the events of every counter, or of the
+ *    dTLB counter only. Events that cannot be opened get fd -1.
+ */
+static void counters_start(int fd[], int all)
+{
+    int e;
+
+    for (e = 0; e < NUM_EVENTS; e++) {
+        fd[e] = all || events[e].counter == DTLB_MISSES ? perf_open(events[e].type, events[e].config) : -1;
+        if (fd[e] >= 0)
+            ioctl(fd[e], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+/*
+ * counters_stop - read and close the events opened by counters_start().
+ *    count[c] is the total of counter c, scaled for the time its events
+ *    were not scheduled, or -1 if none of them could be read.
+ */
+static void counters_stop(int fd[], double count[])
+{
+    uint64_t val[3];    /* value, time enabled, time running */
+    int c, e;
+
+    for (c = 0; c < NUM_COUNTERS; c++)
+        count[c] = -1;
+    for (e = 0; e < NUM_EVENTS; e++) {
+        if (fd[e] < 0)
+            continue;
+        if (read(fd[e], val, sizeof(val)) == sizeof(val) && val[2] > 0) {
+            c = events[e].counter;
+            count[c] = (count[c] < 0 ? 0 : count[c]) + (double)val[0] * val[1] / val[2];
+        }
+        close(fd[e]);
+    }
+}
+
+/*
+ * print_counters - the -p columns: counts per op, and instructions per cycle
+ */
+static void print_counters(double count[], double ops)
+{
+    int c;
+
+    for (c = 0; c < NUM_COUNTERS; c++) {
+        if (count[c] < 0)
+            printf(" %10s", "n/a");
+        else
+            printf(" %10.2f", count[c] / ops);
+    }
+    if (count[CYCLES] > 0 && count[INSTRUCTIONS] >= 0)
+        printf(" %6.2f\n", count[INSTRUCTIONS] / count[CYCLES]);
+    else
+        printf(" %6s\n", "n/a");
+}
+
+/*
+ * run - replay the trace reps times in the given huge page mode and
+ *    print one line of results. A budget_us >= 0 replays through handles.
+ *    With all_counters it prints the -p columns.
+ */
+static void run(char *name, trace_t *trace, int reps, int hugepages, long budget_us, int all_counters)
+{
+    int fd[NUM_EVENTS], i, c;
+    double count[NUM_COUNTERS], ops = (double)trace->num_ops * reps;
+    struct timespec start, end;
+    double secs;
+
+    mem_deinit();
+    mem_set_hugepages(hugepages);
+    mem_init();
+
+    counters_start(fd, all_counters);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < reps; i++) {
+        if ((budget_us < 0 ? replay(trace) : replay_handles(trace, budget_us)) < 0) {
+            printf("%-20s %-5s allocator failed\n", name, hugepages ? "huge" : "4k");
+            counters_stop(fd, count);
+            return;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    counters_stop(fd, count);
+
+    printf("%-20s %-5s %10.0f %10.3f", name, hugepages ? "huge" : "4k", ops / secs / 1e3, mem_heapsize() / 1e6);
+    if (all_counters) {
+        print_counters(count, ops);
+        for (c = 0; c < NUM_COUNTERS; c++) {
+            if (count[c] < 0)
+                total_missing[c] = 1;
+            else
+                total_counts[c] += count[c];
+        }
+        total_ops += ops;
+    } else if (count[DTLB_MISSES] >= 0) {
+        printf(" %14.0f %10.3f\n", count[DTLB_MISSES], count[DTLB_MISSES] / ops);
+    } else {
+        printf(" %14s %10s\n", "n/a", "n/a");
+    }
+}
+
+/*
+ * chains - grow CHAINS buffers to max bytes reps times, and print the time
+ *    taken by mm_realloc() and by the reads of the hot set
+ */
+static void chains(char *name, size_t max, int reps)
+{
+    static long hot[HOT_SET / sizeof(long)];
+    struct timespec start, end;
+    double realloc_secs = 0, hot_secs = 0, copied = 0;
+    size_t size[CHAINS], old, i;
+    char *p[CHAINS], *np;
+    long sum = 0;
+    int r, c, steps = 0;
+
+    for (r = 0; r < reps; r++) {
+        mem_reset_brk();
+        if (mm_init() < 0)
+            break;
+        for (c = 0; c < CHAINS; c++) {
+            size[c] = CHAIN_START;
+            p[c] = mm_malloc(size[c]);
+            memset(p[c], c, size[c]);
+        }
+        while (size[CHAINS - 1] < max) {
+            for (c = 0; c < CHAINS; c++) {
+                old = size[c];
+                size[c] += size[c] / 4;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                np = mm_realloc(p[c], size[c]);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                realloc_secs += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+                if (np == NULL) {
+                    printf("%-20s allocator failed\n", name);
+                    return;
+                }
+                if (np != p[c])
+                    copied += old;
+                p[c] = np;
+                memset(p[c] + old, c, size[c] - old);
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (i = 0; i < HOT_SET / sizeof(long); i++)
+                    sum += hot[i];
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                hot_secs += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+                steps++;
+            }
+        }
+    }
+    hot[sum & 1]++;
+    printf("%-20s %10.3f %10.2f %10.0f\n", name,
+           realloc_secs * 1e3 / reps, copied / realloc_secs / 1e9, hot_secs * 1e9 / steps);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mmbench [-hHp] [-f <file>] [-t <dir>] [-n <reps>] [-c <us>] [-R <MB>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-c <us>    Use relocatable blocks, compacting <us> microseconds per free.\n");
+    fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H         Replay each trace with and without huge pages.\n");
+    fprintf(stderr, "\t-n <reps>  Replay each trace <reps> times (default %d).\n", DEFAULT_REPS);
+    fprintf(stderr, "\t-p         Report cycles, instructions, cache, TLB and branch misses per op.\n");
+    fprintf(stderr, "\t-R <MB>    Grow realloc chains to <MB>, with and without the large copy path.\n");
+    fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+}
+
+int main(int argc, char **argv)
+{
+    char *tracedir = DEFAULT_TRACEDIR;
+    char *tracefile = NULL;
+    char path[MAXLINE];
+    int reps = DEFAULT_REPS;
+    long budget_us = -1;
+    int both = 0;
+    int all_counters = 0;
+    size_t chain_max = 0, large_copy;
+    int hugepages;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "c:f:hHn:pR:t:")) != EOF) {
+        switch (c) {
+        case 'c':
+            budget_us = atol(optarg);
+            break;
+        case 'f':
+            tracefile = optarg;
+            break;
+        case 'H':
+            both = 1;
+            break;
+        case 'n':
+            reps = atoi(optarg);
+            break;
+        case 'p':
+            all_counters = 1;
+            break;
+        case 'R':
+            chain_max = (size_t)(atof(optarg) * (1 << 20));
+            break;
+        case 't':
+            tracedir = optarg;
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+
+    mem_init();
+    hugepages = mem_hugepagesize() != 0;
+    if (chain_max > 0) {
+        printf("%-20s %10s %10s %10s\n", "realloc copy", "ms/run", "GB/s", "hot ns");
+        large_copy = mm_large_copy(0);
+        chains("memcpy", chain_max, reps);
+        mm_large_copy(large_copy);
+        chains("large copy", chain_max, reps);
+        mem_deinit();
+        return 0;
+    }
+    printf("%-20s %-5s %10s %10s", "trace", "pages", "Kops", "heap(MB)");
+    if (all_counters) {
+        for (c = 0; c < NUM_COUNTERS; c++)
+            printf(" %10s", counter_names[c]);
+        printf(" %6s\n", "IPC");
+    } else {
+        printf(" %14s %10s\n", "dTLB-misses", "misses/op");
+    }
+    for (i = 0; tracefile != NULL ? i == 0 : default_tracefiles[i] != NULL; i++) {
+        char *name = tracefile != NULL ? tracefile : default_tracefiles[i];
+        trace_t *trace;
+
+        if (tracefile == NULL)
+            snprintf(path, sizeof(path), "%s/%s", tracedir, name);
+        else
+            snprintf(path, sizeof(path), "%s", name);
+        trace = read_trace(path);
+
+        run(name, trace, reps, both ? 0 : hugepages, budget_us, all_counters);
+        if (both)
+            run(name, trace, reps, 1, budget_us, all_counters);
+        free_trace(trace);
+    }
+    if (all_counters && total_ops > 0) {
+        for (c = 0; c < NUM_COUNTERS; c++)
+            if (total_missing[c])
+                total_counts[c] = -1;
+        printf("%-20s %-5s %10s %10s", "all", "", "", "");
+        print_counters(total_counts, total_ops);
+    }
+    mem_deinit();
+    return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * mmcontend.c - false sharing benchmark for MM_CACHELINE_ISOLATED.
+ *
+ * Allocates one small counter per thread, back to back the way a program
+ * sets up its per-thread state, then has every thread increment its own
+ * counter -n times. With default placement the counters share cache lines,
+ * so each increment takes the line away from the other threads' cores;
+ * with mm_malloc_flags(size, MM_CACHELINE_ISOLATED) each counter has its
+ * lines to itself. Both modes are run in turn and report the increments
+ * per second over all threads, how many counters share a line with
+ * another, and the heap the counters took.
+ *
+ * After the counters, -f filler blocks of the counter size are allocated
+ * as the rest of a program would; the heap they add shows whether the
+ * free space an isolated block leaves before its line boundary is reused.
+ *
+ * Thread i runs on CPU i modulo the CPUs there are. On a single CPU the
+ * threads take turns and no line ever bounces, so both modes run at the
+ * same speed there.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define MAX_THREADS 64
+#define DEFAULT_THREADS 4
+#define DEFAULT_ITERS 50000000L
+#define DEFAULT_SIZE 16
+#define DEFAULT_FILLERS 256
+#define LINE 64
+
+typedef struct {
+    int cpu;
+    long iters;
+    volatile long *counter;
+    pthread_barrier_t *start;
+    double begin, end;      /* when this thread started and finished counting */
+} worker_t;
+
+/*
+ * now - monotonic time in seconds
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * work - one thread: increment its own counter
+ */
+static void *work(void *arg)
+{
+    worker_t *w = arg;
+    cpu_set_t set;
+    long i;
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    pthread_barrier_wait(w->start);
+    w->begin = now();
+    for (i = 0; i < w->iters; i++)
+        (*w->counter)++;
+    w->end = now();
+    return NULL;
+}
+
+/*
+ * shared - how many of the n counters of size bytes have a cache line
+ *    in common with another one
+ */
+static int shared(volatile long **counter, int n, size_t size)
+{
+    int i, j, count = 0;
+
+    for (i = 0; i < n; i++)
+        for (j = 0; j < n; j++) {
+            uintptr_t a = (uintptr_t)counter[i], b = (uintptr_t)counter[j];
+            if (i != j && a / LINE <= (b + size - 1) / LINE && b / LINE <= (a + size - 1) / LINE) {
+                count++;
+                break;
+            }
+        }
+    return count;
+}
+
+/*
+ * run - allocate the counters with the given flags and time the threads
+ */
+static void run(const char *name, int flags, int threads, long iters, size_t size, int fillers)
+{
+    volatile long *counter[MAX_THREADS];
+    worker_t w[MAX_THREADS];
+    pthread_t tid[MAX_THREADS];
+    pthread_barrier_t start;
+    size_t before, counters;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    double begin, end;
+    int i;
+
+    mem_reset_brk();
+    if (mm_init() < 0) {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+    before = mem_heapsize();
+    for (i = 0; i < threads; i++) {
+        if ((counter[i] = mm_malloc_flags(size, flags)) == NULL) {
+            fprintf(stderr, "mm_malloc_flags failed\n");
+            exit(1);
+        }
+        if ((flags & MM_CACHELINE_ISOLATED) && (uintptr_t)counter[i] % LINE != 0) {
+            fprintf(stderr, "%s: counter %d at %p is not line aligned\n", name, i, (void *)counter[i]);
+            exit(1);
+        }
+        *counter[i] = 0;
+    }
+    counters = mem_heapsize() - before;
+    before = mem_heapsize();
+    for (i = 0; i < fillers; i++)
+        if (mm_malloc(size) == NULL) {
+            fprintf(stderr, "mm_malloc failed\n");
+            exit(1);
+        }
+
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (i = 0; i < threads; i++) {
+        w[i] = (worker_t){ ncpu > 0 ? i % ncpu : 0, iters, counter[i], &start, 0, 0 };
+        pthread_create(&tid[i], NULL, work, &w[i]);
+    }
+    // Time from the first thread starting to the last one finishing: the
+    // threads can be done before this one returns from the barrier.
+    pthread_barrier_wait(&start);
+    for (i = 0; i < threads; i++)
+        pthread_join(tid[i], NULL);
+    pthread_barrier_destroy(&start);
+    for (begin = w[0].begin, end = w[0].end, i = 1; i < threads; i++) {
+        begin = w[i].begin < begin ? w[i].begin : begin;
+        end = w[i].end > end ? w[i].end : end;
+    }
+
+    for (i = 0; i < threads; i++)
+        if (*counter[i] != iters) {
+            fprintf(stderr, "%s: counter %d is %ld, expected %ld\n", name, i, *counter[i], iters);
+            exit(1);
+        }
+    printf("%-10s %10.1f %8d %12zu %12zu\n", name, threads * iters / (end - begin) / 1e6,
+           shared(counter, threads, size), counters, mem_heapsize() - before);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mmcontend [-h] [-t <threads>] [-n <iterations>] [-s <size>] [-f <fillers>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-t <n>     Run <n> threads (default %d).\n", DEFAULT_THREADS);
+    fprintf(stderr, "\t-n <n>     Increments per thread (default %ld).\n", DEFAULT_ITERS);
+    fprintf(stderr, "\t-s <size>  Counter size in bytes (default %d).\n", DEFAULT_SIZE);
+    fprintf(stderr, "\t-f <n>     Filler blocks allocated after the counters (default %d).\n", DEFAULT_FILLERS);
+}
+
+int main(int argc, char **argv)
+{
+    int threads = DEFAULT_THREADS, fillers = DEFAULT_FILLERS;
+    long iters = DEFAULT_ITERS;
+    size_t size = DEFAULT_SIZE;
+    char c;
+
+    while ((c = getopt(argc, argv, "f:hn:s:t:")) != EOF) {
+        switch (c) {
+        case 'f':
+            fillers = atoi(optarg);
+            break;
+        case 'n':
+            iters = atol(optarg);
+            break;
+        case 's':
+            size = atol(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (threads < 1 || threads > MAX_THREADS || iters < 1 || size < sizeof(long) || fillers < 0) {
+        usage();
+        exit(1);
+    }
+
+    mem_init();
+    printf("%d threads on %ld CPUs, %zu byte counters, %ld increments each\n",
+           threads, sysconf(_SC_NPROCESSORS_ONLN), size, iters);
+    printf("%-10s %10s %8s %12s %12s\n", "placement", "Mops/s", "shared", "heap bytes", "filler heap");
+    run("default", 0, threads, iters, size, fillers);
+    run("isolated", MM_CACHELINE_ISOLATED, threads, iters, size, fillers);
+    return 0;
+}
@@ -0,0 +1,464 @@
+/*
+ * mmmicro.c - microbenchmarks for the internal primitives of mm.c.
+ *
+ * mmbench times whole traces; when its Kops move, this tells which path
+ * moved them. Each benchmark builds a synthetic heap state untimed, then
+ * times one batch of calls to a single primitive on it:
+ *
+ *   add_free_block     put free, unlisted blocks on a list
+ *   remove_free_block  take listed blocks off again
+ *   find_fit           best fit with param free blocks in the bin
+ *   find_fit_miss      the same bin misses, the next bin has the fit
+ *   coalesce           cases 1 to 4 (param) of coalesce()
+ *   place              with param 1 a split, with 0 none
+ *   extend_heap        grow the heap by param bytes
+ *   realloc_inplace    mm_realloc() to a smaller size that still fits
+ *   realloc_extend     mm_realloc() of the last block, growing the heap
+ *
+ * mm.c is compiled into this file, so the benchmarks reach its statics
+ * and boundary tag macros; it runs over memlib_os.c like mmbench. Each
+ * benchmark runs a warm-up round and then -n rounds (default 11) on the
+ * CPU it started on; the median and the fastest round are reported in
+ * nanoseconds per call.
+ *
+ * -j <file> writes the results as JSON, one benchmark per line. With
+ * -b <file> each result is compared with that earlier JSON, and mmmicro
+ * exits with status 1 if any median got slower by more than -r percent
+ * (default 10).
+ */
+#define _GNU_SOURCE
+#include <sched.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "mm.c"
+
+#define MAXLINE 1024
+#define DEFAULT_ROUNDS 11
+#define DEFAULT_REGRESSION 10.0
+#define BATCH 4096          /* calls timed per round */
+#define MAX_ROUNDS 101
+
+/* The blocks a setup leaves for its benchmark, one per timed call */
+static char *blocks[BATCH];
+static size_t query;        /* find_fit's request */
+static size_t moved;        /* realloc_extend calls that did not extend */
+
+/* One benchmark: setup builds the heap state, run makes BATCH timed calls */
+typedef struct {
+    char *name;
+    int param;
+    void (*setup)(int param);
+    void (*run)(int param);
+} bench_t;
+
+/*
+ * fresh_heap - start an empty heap, exits if the allocator fails
+ */
+static void fresh_heap(void)
+{
+    mem_reset_brk();
+    if (mm_init() < 0) {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+}
+
+/*
+ * bench_failed - a primitive did not do what its benchmark set it up for
+ */
+static void bench_failed(const char *where)
+{
+    fprintf(stderr, "%s: unexpected result, heap state is not what the setup built\n", where);
+    exit(1);
+}
+
+/*
+ * must_malloc - mm_malloc() that exits on failure
+ */
+static char *must_malloc(size_t size)
+{
+    char *p;
+
+    if ((p = mm_malloc(size)) == NULL) {
+        fprintf(stderr, "mm_malloc(%zu) failed\n", size);
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * free_blocks - BATCH free blocks of payload size, each followed by an
+ *    allocated separator so none of them coalesce
+ */
+static void free_blocks(size_t size)
+{
+    int i;
+
+    fresh_heap();
+    for (i = 0; i < BATCH; i++) {
+        blocks[i] = must_malloc(size);
+        must_malloc(16);
+    }
+    for (i = 0; i < BATCH; i++)
+        mm_free(blocks[i]);
+}
+
+static void setup_add(int param)
+{
+    int i;
+
+    (void)param;
+    free_blocks(64);
+    for (i = 0; i < BATCH; i++)
+        remove_free_block(blocks[i]);
+}
+
+static void run_add(int param)
+{
+    int i;
+
+    (void)param;
+    for (i = 0; i < BATCH; i++)
+        add_free_block(blocks[i]);
+}
+
+static void setup_remove(int param)
+{
+    (void)param;
+    free_blocks(64);
+}
+
+static void run_remove(int param)
+{
+    int i;
+
+    (void)param;
+    for (i = 0; i < BATCH; i++)
+        remove_free_block(blocks[i]);
+}
+
+/*
+ * setup_fit - param free blocks of sizes spread over the 512 byte bin,
+ *    the largest freed first. find_fit asks for the largest; find_fit_miss
+ *    for 512 bytes, which only a free block in the next bin holds.
+ */
+static void setup_fit(int param)
+{
+    unsigned int seed = 1;
+    char *p[BATCH];
+    int i;
+
+    fresh_heap();
+    query = 0;
+    for (i = 0; i < param; i++) {
+        seed = seed * 1103515245 + 12345;
+        p[i] = must_malloc(i == 0 ? 440 : 256 + (seed >> 16) % 24 * 8);
+        if (GET_SIZE(HDRP(p[i])) > query)
+            query = GET_SIZE(HDRP(p[i]));
+        must_malloc(16);
+    }
+    blocks[0] = must_malloc(1000);
+    must_malloc(16);
+    for (i = 0; i < param; i++)
+        mm_free(p[i]);
+    mm_free(blocks[0]);
+}
+
+static void run_fit(int param)
+{
+    int i;
+
+    (void)param;
+    for (i = 0; i < BATCH; i++)
+        if (find_fit(query, 0) == NULL)
+            bench_failed(__func__);
+}
+
+static void run_fit_miss(int param)
+{
+    int i;
+
+    (void)param;
+    for (i = 0; i < BATCH; i++)
+        if (find_fit(512, 0) != blocks[0])
+            bench_failed(__func__);
+}
+
+/*
+ * setup_coalesce - BATCH runs of previous, block, next and separator, with
+ *    the neighbours coalesce case param frees, and the block marked free
+ *    but not yet coalesced, as mm_free() leaves it
+ */
+static void setup_coalesce(int param)
+{
+    char *prev[BATCH], *next[BATCH];
+    size_t size, hint;
+    int i;
+
+    fresh_heap();
+    for (i = 0; i < BATCH; i++) {
+        prev[i] = must_malloc(64);
+        blocks[i] = must_malloc(64);
+        next[i] = must_malloc(64);
+        must_malloc(16);
+    }
+    for (i = 0; i < BATCH; i++) {
+        if (param == 3 || param == 4)
+            mm_free(prev[i]);
+        if (param == 2 || param == 4)
+            mm_free(next[i]);
+        size = GET_SIZE(HDRP(blocks[i]));
+        hint = GET(HDRP(blocks[i])) & HINT_MASK;
+        PUT(HDRP(blocks[i]), PACK(size, hint));
+        PUT(FTRP(blocks[i]), PACK(size, hint));
+    }
+}
+
+static void run_coalesce(int param)
+{
+    int i;
+
+    (void)param;
+    for (i = 0; i < BATCH; i++)
+        coalesce(blocks[i]);
+}
+
+static void setup_place(int param)
+{
+    (void)param;
+    free_blocks(1000);
+}
+
+static void run_place(int param)
+{
+    int i;
+
+    for (i = 0; i < BATCH; i++)
+        place(blocks[i], param ? GET_SIZE(HDRP(blocks[i])) / 2 : GET_SIZE(HDRP(blocks[i])) - DSIZE);
+}
+
+static void setup_extend(int param)
+{
+    (void)param;
+    fresh_heap();
+}
+
+static void run_extend(int param)
+{
+    int i;
+
+    for (i = 0; i < BATCH; i++)
+        if (extend_heap(param / WSIZE, 0) == NULL)
+            bench_failed(__func__);
+}
+
+static void setup_realloc_inplace(int param)
+{
+    int i;
+
+    (void)param;
+    fresh_heap();
+    for (i = 0; i < BATCH; i++)
+        blocks[i] = must_malloc(256);
+}
+
+static void run_realloc_inplace(int param)
+{
+    int i;
+
+    (void)param;
+    for (i = 0; i < BATCH; i++)
+        mm_realloc(blocks[i], 200);
+}
+
+static void setup_realloc_extend(int param)
+{
+    (void)param;
+    fresh_heap();
+    blocks[0] = must_malloc(64);
+}
+
+static void run_realloc_extend(int param)
+{
+    char *p;
+    int i;
+
+    for (i = 0; i < BATCH; i++) {
+        if ((p = mm_realloc(blocks[0], 64 + (size_t)(i + 1) * param)) == NULL)
+            bench_failed(__func__);
+        if (p != blocks[0])
+            moved++;
+        blocks[0] = p;
+    }
+}
+
+static bench_t benches[] = {
+    { "add_free_block", 0, setup_add, run_add },
+    { "remove_free_block", 0, setup_remove, run_remove },
+    { "find_fit", 1, setup_fit, run_fit },
+    { "find_fit", 16, setup_fit, run_fit },
+    { "find_fit", 64, setup_fit, run_fit },
+    { "find_fit", 1024, setup_fit, run_fit },
+    { "find_fit_miss", 1, setup_fit, run_fit_miss },
+    { "find_fit_miss", 64, setup_fit, run_fit_miss },
+    { "find_fit_miss", 1024, setup_fit, run_fit_miss },
+    { "coalesce", 1, setup_coalesce, run_coalesce },
+    { "coalesce", 2, setup_coalesce, run_coalesce },
+    { "coalesce", 3, setup_coalesce, run_coalesce },
+    { "coalesce", 4, setup_coalesce, run_coalesce },
+    { "place", 0, setup_place, run_place },
+    { "place", 1, setup_place, run_place },
+    { "extend_heap", 4096, setup_extend, run_extend },
+    { "realloc_inplace", 0, setup_realloc_inplace, run_realloc_inplace },
+    { "realloc_extend", 64, setup_realloc_extend, run_realloc_extend },
+};
+#define NUM_BENCHES (int)(sizeof(benches) / sizeof(benches[0]))
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * time_bench - run a warm-up round and then rounds timed rounds of b,
+ *    returning the median and fastest time per call in nanoseconds
+ */
+static void time_bench(bench_t *b, int rounds, double *median, double *min)
+{
+    double ns[MAX_ROUNDS];
+    struct timespec start, end;
+    int r;
+
+    for (r = -1; r < rounds; r++) {
+        b->setup(b->param);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        b->run(b->param);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (r >= 0)
+            ns[r] = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / BATCH;
+    }
+    qsort(ns, rounds, sizeof(double), cmp_double);
+    *median = ns[rounds / 2];
+    *min = ns[0];
+}
+
+/*
+ * baseline_median - the median of name/param in a JSON file written by
+ *    -j, or -1 if it is not there
+ */
+static double baseline_median(FILE *fp, char *name, int param)
+{
+    char line[MAXLINE], bname[MAXLINE];
+    int bparam;
+    double median;
+
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp) != NULL)
+        if (sscanf(line, " {\"name\": \"%[^\"]\", \"param\": %d, \"median_ns\": %lf", bname, &bparam, &median) == 3
+                && strcmp(bname, name) == 0 && bparam == param)
+            return median;
+    return -1;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mmmicro [-h] [-n <rounds>] [-j <file>] [-b <file> [-r <pct>]]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b <file>    Compare with the results in <file>; exit 1 on a regression.\n");
+    fprintf(stderr, "\t-h           Print this message.\n");
+    fprintf(stderr, "\t-j <file>    Write the results to <file> as JSON.\n");
+    fprintf(stderr, "\t-n <rounds>  Timed rounds per benchmark (default %d).\n", DEFAULT_ROUNDS);
+    fprintf(stderr, "\t-r <pct>     Slowdown that counts as a regression (default %.0f).\n", DEFAULT_REGRESSION);
+}
+
+int main(int argc, char **argv)
+{
+    char *json = NULL, *baseline = NULL;
+    int rounds = DEFAULT_ROUNDS, regressions = 0;
+    double limit = DEFAULT_REGRESSION, median, min, base;
+    FILE *out = NULL, *base_fp = NULL;
+    cpu_set_t cpus;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "b:hj:n:r:")) != EOF) {
+        switch (c) {
+        case 'b':
+            baseline = optarg;
+            break;
+        case 'j':
+            json = optarg;
+            break;
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        case 'r':
+            limit = atof(optarg);
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (rounds < 1 || rounds > MAX_ROUNDS) {
+        fprintf(stderr, "Rounds must be between 1 and %d\n", MAX_ROUNDS);
+        exit(1);
+    }
+    if (baseline != NULL && (base_fp = fopen(baseline, "r")) == NULL) {
+        fprintf(stderr, "Could not open %s\n", baseline);
+        exit(1);
+    }
+    if (json != NULL && (out = fopen(json, "w")) == NULL) {
+        fprintf(stderr, "Could not open %s\n", json);
+        exit(1);
+    }
+
+    // Stay on one CPU, so no round pays for a migration.
+    CPU_ZERO(&cpus);
+    CPU_SET(sched_getcpu(), &cpus);
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+
+    mem_init();
+    printf("%-20s %6s %10s %10s", "primitive", "param", "median(ns)", "min(ns)");
+    printf(base_fp != NULL ? " %10s %8s\n" : "\n", "base(ns)", "change");
+    if (out != NULL)
+        fprintf(out, "{\"rounds\": %d, \"batch\": %d, \"benchmarks\": [\n", rounds, BATCH);
+
+    for (i = 0; i < NUM_BENCHES; i++) {
+        bench_t *b = &benches[i];
+
+        time_bench(b, rounds, &median, &min);
+        printf("%-20s %6d %10.2f %10.2f", b->name, b->param, median, min);
+        if (base_fp != NULL) {
+            if ((base = baseline_median(base_fp, b->name, b->param)) > 0) {
+                printf(" %10.2f %+7.1f%%", base, (median / base - 1) * 100);
+                if (median > base * (1 + limit / 100)) {
+                    printf("  REGRESSION");
+                    regressions++;
+                }
+            } else {
+                printf(" %10s %8s", "n/a", "");
+            }
+        }
+        printf("\n");
+        if (out != NULL)
+            fprintf(out, "  {\"name\": \"%s\", \"param\": %d, \"median_ns\": %.3f, \"min_ns\": %.3f}%s\n",
+                    b->name, b->param, median, min, i < NUM_BENCHES - 1 ? "," : "");
+    }
+    if (moved > 0)
+        printf("warning: realloc_extend moved its block %zu times\n", moved);
+
+    if (out != NULL) {
+        fprintf(out, "]}\n");
+        fclose(out);
+    }
+    if (base_fp != NULL)
+        fclose(base_fp);
+    mem_deinit();
+    return regressions > 0;
+}
@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# tune.sh - search the build-time tunables of mm.c.
+#
+# Builds mdriver once for every combination of the values below, replays
+# the traces with each build, and prints the configurations on the Pareto
+# frontier of utilization versus throughput: those no other configuration
+# beats on both. Every result is also written to the results file.
+#
+#     unix> make tune
+#     unix> LIMIT="1 100" PAD_ROUND="0 32" ./tune.sh -t ../traces
+#
+# Each variable holds the values to try for the mm.c macro of the same name.
+# Throughput is mdriver's Kops, the best of REPS runs.
+#
+# usage: tune.sh [-t <tracedir>] [-o <results>]
+
+NUM_OF_FREE_LISTS=${NUM_OF_FREE_LISTS:-"20 30"}
+LIMIT=${LIMIT:-"1 8 100"}
+CHUNKSIZE=${CHUNKSIZE:-"32 4096"}
+SPLIT_DEFAULT=${SPLIT_DEFAULT:-"32 144 256"}
+PAD_ROUND=${PAD_ROUND:-"0 32 64"}
+REPS=${REPS:-1}
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:-"-Wall -O1 -g"}
+DRIVER_OBJS="mdriver.o memlib.o fsecs.o fcyc.o clock.o ftimer.o"
+
+tracedir=../traces
+results=tune.out
+while getopts "t:o:h" c; do
+    case $c in
+    t) tracedir=$OPTARG ;;
+    o) results=$OPTARG ;;
+    *) echo "usage: $0 [-t <tracedir>] [-o <results>]" >&2; exit 1 ;;
+    esac
+done
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+printf "%-6s %-6s %-6s %-6s %-6s %6s %8s\n" lists limit chunk split pad util Kops > "$results"
+for lists in $NUM_OF_FREE_LISTS; do
+for limit in $LIMIT; do
+for chunk in $CHUNKSIZE; do
+for split in $SPLIT_DEFAULT; do
+for pad in $PAD_ROUND; do
+    flags="-DNUM_OF_FREE_LISTS=$lists -DLIMIT=$limit -DCHUNKSIZE=$chunk -DSPLIT_DEFAULT=$split -DPAD_ROUND=$pad"
+    if ! $CC $CFLAGS $flags -c -o "$tmp/mm.o" mm.c 2> "$tmp/cc.log" ||
+       ! $CC $CFLAGS -no-pie -o "$tmp/mdriver" $DRIVER_OBJS "$tmp/mm.o" 2>> "$tmp/cc.log"; then
+        echo "build failed: $flags" >&2
+        cat "$tmp/cc.log" >&2
+        continue
+    fi
+
+    # The Total line of mdriver -V: "Total  <util>%  <ops>  <secs>  <Kops>".
+    # A build that fails a trace is left out.
+    best=""
+    i=0
+    while [ $i -lt "$REPS" ]; do
+        line=$("$tmp/mdriver" -V -t "$tracedir" 2> /dev/null |
+               awk '$2 == "no" { bad = 1 } $1 == "Total" { sub("%", "", $2); t = $2 " " $5 } END { if (!bad) print t }')
+        [ -z "$line" ] && break
+        best=$(printf "%s\n%s\n" "$best" "$line" | awk 'NF == 2 && $2 > k { k = $2; u = $1 } END { print u, k }')
+        i=$((i + 1))
+    done
+    if [ -z "$line" ]; then
+        echo "trace failed: $flags" >&2
+        continue
+    fi
+    set -- $best
+    printf "%-6s %-6s %-6s %-6s %-6s %6s %8s\n" $lists $limit $chunk $split $pad $1 $2 | tee -a "$results"
+done
+done
+done
+done
+done
+
+# Walk the configurations from most to least utilization (ties: fastest
+# first) and keep each one that is faster than everything before it.
+echo
+echo "Pareto frontier (util vs Kops):"
+head -1 "$results"
+tail -n +2 "$results" | sort -k6,6nr -k7,7nr | awk '$7 > best { best = $7; print }'